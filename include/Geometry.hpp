@@ -0,0 +1,102 @@
+#ifndef GEOMETRY
+#define GEOMETRY
+
+#include "opencv2/core/core.hpp"
+#include <vector>
+#include <cfloat>
+
+using namespace cv;
+
+/*! \brief Ellipse with its affine transform to the unit circle precomputed.
+  *
+  * The rotation and the inverse half axes are computed once when the transform is built, so the normalized distance
+  * of a point costs a few multiplications instead of the trigonometric calls of distEllipse2Point. Points with a
+  * distance below 1 lie inside the ellipse.
+  */
+class EllipseTransform{
+public:
+    /*! Center of the ellipse */
+    Point2f center;
+
+    /*! Cosine and sine of the negated ellipse angle */
+    float cosA;
+    float sinA;
+
+    /*! Inverse half axes, 0 for degenerate ellipses */
+    float invA;
+    float invB;
+
+    /*! False if one of the axes has zero length. Degenerate ellipses contain no points. */
+    bool valid;
+
+    EllipseTransform();
+    EllipseTransform(const RotatedRect& ellipse);
+
+    /*! Squared normalized distance of a point to the center of the ellipse, FLT_MAX for degenerate ellipses */
+    inline float distance(Point2f pt) const{
+        if (!valid){
+            return FLT_MAX;
+        }
+        float dx = pt.x-center.x;
+        float dy = pt.y-center.y;
+        float u = (cosA*dx-sinA*dy)*invA;
+        float v = (cosA*dy+sinA*dx)*invB;
+        return u*u+v*v;
+    }
+
+    /*! Distances of the pixels [start, end) in an image row to the ellipse, written to distances[0..end-start).
+      * All distances are FLT_MAX for degenerate ellipses.
+      */
+    void rowDistances(int row, int start, int end, float* distances) const;
+
+    /*! Span [start, end) of pixels of an image row that lie inside the ellipse, clipped to [0, width).
+      * \return false if the row does not intersect the ellipse
+      */
+    bool rowSpan(int row, int width, int& start, int& end) const;
+
+    /*! Range of image rows [top, bottom] touched by the ellipse, clipped to [0, height) */
+    void rowRange(int height, int& top, int& bottom) const;
+
+protected:
+    //coefficients of the row quadratic qa*dx^2 + qb*dx*dy + qc*dy^2
+    double qa;
+    double qb;
+    double qc;
+};
+
+/*! \brief Oriented bounding box with its corners and edge normals precomputed.
+  *
+  * Intersection uses the separating axis test on the edge normals of both boxes, and distance is the minimum over
+  * the corner-to-edge distances in both directions, the same quantities intersectingOBB and distRotatedRect compute
+  * without building any matrices.
+  */
+class OrientedBox{
+public:
+    /*! Corner coordinates in the order of RotatedRect::points */
+    float cornerX[4];
+    float cornerY[4];
+
+    /*! Unit axes the box is aligned with */
+    Point2f axes[2];
+
+    OrientedBox();
+    OrientedBox(const RotatedRect& box);
+
+    bool intersects(const OrientedBox& other) const;
+
+    /*! Smallest corner to edge distance between the two boxes */
+    float distance(const OrientedBox& other) const;
+
+protected:
+    //edge i runs from corner i to corner i+1
+    float edgeX[4];
+    float edgeY[4];
+    float invEdgeLengthSq[4];
+    //projections of the corners onto the own axes
+    float minProj[2];
+    float maxProj[2];
+    void project(Point2f axis, float& minimum, float& maximum) const;
+    float cornerToEdgeDistanceSq(const OrientedBox& other) const;
+};
+
+#endif
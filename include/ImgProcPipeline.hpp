@@ -4,9 +4,87 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/video/video.hpp"
 #include <iostream>
+#include <cmath>
 
 using namespace cv;
 
+/*! \brief Gaussian probability density function of fixed dimensionality N with cached inverse covariance.
+  *
+  * The inverse covariance matrix and the logarithm of the normalization term are computed once when the kernel
+  * is set, so evaluating the density at a point costs a single quadratic form and an exp, without allocating any
+  * temporary matrices. The two-dimensional case is specialized with a closed-form inverse.
+  */
+template<int N>
+class GaussianKernel{
+public:
+    /*! Mean vector */
+    double mean[N];
+
+    /*! Inverse of the covariance matrix */
+    double inverseCovariance[N][N];
+
+    /*! Logarithm of the normalization term, -(N*log(2*pi)+log(det))/2 */
+    double logNormalization;
+
+    /*! False if the covariance matrix the kernel was set from is singular. Invalid kernels evaluate to 0 everywhere. */
+    bool valid;
+
+    /*! Default constructor. Creates an invalid kernel. */
+    GaussianKernel() : logNormalization(0), valid(false) {}
+
+    /*! Sets the kernel parameters.
+      * \param meanVector Nx1 mean vector of type CV_64F
+      * \param covarianceMatrix NxN covariance matrix of type CV_64F
+      */
+    void set(const Mat& meanVector, const Mat& covarianceMatrix){
+        double det = determinant(covarianceMatrix);
+        valid = det>1e-300;
+        if (!valid){
+            return;
+        }
+        Mat inverse = covarianceMatrix.inv();
+        for (int i=0; i<N; i++){
+            mean[i] = meanVector.at<double>(i,0);
+            for (int j=0; j<N; j++){
+                inverseCovariance[i][j] = inverse.at<double>(i,j);
+            }
+        }
+        logNormalization = -0.5*(N*std::log(2*CV_PI)+std::log(det));
+    }
+
+    /*! Returns the logarithm of the density function at point x.
+      * \param x Pointer to N consecutive coordinates
+      */
+    double logDensity(const double* x) const{
+        double diff[N];
+        for (int i=0; i<N; i++){
+            diff[i] = x[i]-mean[i];
+        }
+        double quadratic = 0;
+        for (int i=0; i<N; i++){
+            for (int j=0; j<N; j++){
+                quadratic += diff[i]*inverseCovariance[i][j]*diff[j];
+            }
+        }
+        return logNormalization-0.5*quadratic;
+    }
+
+    /*! Returns the value of the density function at point x.
+      * \param x Pointer to N consecutive coordinates
+      */
+    double density(const double* x) const{
+        return valid ? std::exp(logDensity(x)) : 0.0;
+    }
+};
+
+template<> void GaussianKernel<2>::set(const Mat& meanVector, const Mat& covarianceMatrix);
+
+template<> inline double GaussianKernel<2>::logDensity(const double* x) const{
+    double d0 = x[0]-mean[0];
+    double d1 = x[1]-mean[1];
+    return logNormalization-0.5*(inverseCovariance[0][0]*d0*d0 + 2*inverseCovariance[0][1]*d0*d1 + inverseCovariance[1][1]*d1*d1);
+}
+
 /*! \brief A class for constructing multivariate gaussian mixture models using the EM algorithm
   *     with built-in support for generalizing histograms.
   *
@@ -34,8 +112,23 @@ class GaussianMixtureModel{
     /*! M-dimensional vector of Nx1 gaussian density function means */
     std::vector<Mat> meanVector;
 
-    /*! Temporary variable used to store datapoint - component correspondence */
-    Mat componentProbability;
+    /*! Kernels with cached inverse covariances, kept in sync with the model parameters in the two-dimensional case */
+    std::vector<GaussianKernel<2> > kernel2D;
+
+    /*! Rebuilds the cached kernels from the current means and covariance matrices */
+    void updateKernels();
+
+    /*! Initializes the mean vectors by splitting the samples into K consecutive groups of equal size.
+      * \param samples Sample matrix as described in runExpectationMaximization
+      */
+    void initializeMeans(const Mat samples);
+
+    /*! EM algorithm implementation for a model of fixed dimensionality N, using GaussianKernel for density evaluation.
+      * Each iteration is a single fused E+M pass over the samples, split into stripes which are processed in parallel
+      * and reduced at the end. Arguments are the same as in runExpectationMaximization.
+      */
+    template<int N>
+    void runFixedExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease);
 
     /*! Returns the value of a gaussian probability density function defined by its covariance matrix and mean vector.
       * \param x N-dimensional point
@@ -80,8 +173,10 @@ public:
       *     The last element in the row vector is the number of identical data points.
       * \param maxIterations Maximum number of iterations after which the EM algorithm terminates
       * \param minStepIncrease Percentage increase of log likelihood below which the local optimum is presumed to have been achieved
+      * \param warmStart If true and the model is already initialized, iterations start from the current component parameters
+      *     instead of the naive equal-split initialization
       */
-    void runExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease);
+    void runExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease, bool warmStart);
 
     /*! Gets the model value at a point
       * \param x N-dimensional query point
@@ -89,7 +184,7 @@ public:
     double get(const Mat x);
 
     /*! Makes a lookup table in histogram format for easier and faster access.
-      * Only works for two-dimensional gaussian mixture models. The created uniform histogram is defined by the number of bins in
+      * Only works for two-dimensional gaussian mixture models. The table is filled row by row using the cached kernels. The created uniform histogram is defined by the number of bins in
       * each dimension and the range of values in each dimension. The function stores the histogram in the object's lookup attribute
       * after normalizing it so that the max value equals 1
       *
@@ -108,8 +203,9 @@ public:
       * \param c2range Range of histogram values for the second dimension
       * \param maxIter Maximum number of iterations after which the EM algorithm terminates
       * \param minStepIncrease Percentage increase of log likelihood below which the local optimum is presumed to have been achieved
+      * \param warmStart If true and the model is already initialized, refine the current model instead of fitting a new one
       */
-    void fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter, double minStepIncrease);
+    void fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter, double minStepIncrease, bool warmStart);
 
 };
 
@@ -120,6 +216,7 @@ public:
   * gaussian mixture model which can be constructed from the stored histogram whenever needed.
   */
 class Histogram{
+    friend class ColorQuantizer;
 protected:
     /*! Integer matrix used to store the raw number of pixels*/
     Mat accumulator;
@@ -138,6 +235,14 @@ protected:
 
     /*! Gaussian mixture model object*/
     GaussianMixtureModel gmm;
+
+    /*! Fills a lookup table mapping 8-bit channel values to histogram bins, following calcBackProject's uniform binning.
+      * Values outside the histogram range are mapped to -1.
+      *
+      * \param dim Histogram dimension, 0 or 1
+      * \param lut Output table with 256 entries
+      */
+    void makeBinLookup(int dim, int lut[256]);
 public:
     /*! Boolean flag used to check if GMM is initialized*/
     bool gmmReady;
@@ -190,6 +295,23 @@ public:
       */
     void backPropagate(Mat inputImage, Mat* outputImage);
 
+    /*! Runs histogram backpropagation on an 8-bit image and returns an 8-bit fixed-point probability image.
+      * Channel values are mapped to bins through precomputed lookup tables instead of float bin arithmetic. A probability p
+      * is stored as round(255*p), so the output of backPropagate is approximated by the output of this function divided by 255.
+      *
+      * \param inputImage Input image of depth CV_8U already converted to the desired color space
+      * \param outputImage Pointer to the output matrix, of type CV_8UC1
+      */
+    void backPropagate8U(const Mat inputImage, Mat* outputImage);
+
+    /*! Maps every pixel of an 8-bit image to its flat histogram bin index, i*histSize[1]+j, using the same binning as
+      * backPropagate8U. Pixels outside the histogram range are mapped to -1.
+      *
+      * \param inputImage Input image of depth CV_8U already converted to the desired color space
+      * \param outputImage Pointer to the output matrix, of type CV_32SC1
+      */
+    void binIndex(const Mat inputImage, Mat* outputImage);
+
     /*! Makes a gaussian mixture model from the existing histogram and stores a normalized lookup table as the new histogram.
       *
       * \param K Number of components for the gaussian mixture model
@@ -206,6 +328,43 @@ public:
 };
 
 
+/*! A class mapping quantized BGR colors directly to histogram bins.
+  *
+  * Each BGR channel is reduced to a fixed number of bits, and the center of every resulting color cell is converted once
+  * to the histogram's color space and binned. Afterwards, the bin of a BGR pixel is a single table lookup, so a probability
+  * table compiled from any histogram with the same layout turns backpropagation into a single gather, without color
+  * conversion of the input image.
+  */
+class ColorQuantizer{
+public:
+    /*! Number of bits kept per BGR channel, at most 5 so that cell indices fit into 16 bits*/
+    int bits;
+
+    /*! 1 x 2^(3*bits) matrix of type CV_32S with the flat histogram bin index of each color cell, or -1 outside the histogram range*/
+    Mat binLookup;
+
+    /*! Number of bins of the histogram layout the lookup indexes into*/
+    int histSize[2];
+
+    /*! Default constructor*/
+    ColorQuantizer();
+
+    /*! Standard constructor.
+      *
+      * \param colorspaceCode OpenCV color conversion code from BGR to the histogram's color space
+      * \param layout Histogram defining the channels, number of bins and ranges. Its contents are not used.
+      * \param bitsPerChannel Number of bits kept per BGR channel
+      */
+    ColorQuantizer(int colorspaceCode, Histogram layout, int bitsPerChannel);
+
+    /*! Computes the color cell index (b<<2*bits | g<<bits | r) of every pixel.
+      *
+      * \param image Input image of type CV_8UC3 in BGR format
+      * \param index Output matrix of type CV_16UC1
+      */
+    void quantize(const Mat image, Mat& index);
+};
+
 /*! An abstract class used as the base class for all image processing pipeline components.
  */
 class ProcessingElement{
@@ -215,6 +374,30 @@ public:
     virtual void process(const Mat inputImage, Mat* outputImage) = 0;
 };
 
+/*! Smoothing filters which can be applied to an image before histogram backprojection*/
+enum Prefilter{
+    /*! No filtering*/
+    PREFILTER_NONE,
+    /*! 5x5 box filter*/
+    PREFILTER_BOX,
+    /*! 5x5 separable Gaussian filter*/
+    PREFILTER_GAUSSIAN,
+    /*! Bilateral filter applied at half resolution, then upsampled*/
+    PREFILTER_BILATERAL_DOWNSAMPLED,
+    /*! Self-guided filter with a 5x5 window, computed per channel with box filters*/
+    PREFILTER_GUIDED,
+    /*! Full resolution 5x5 bilateral filter*/
+    PREFILTER_BILATERAL
+};
+
+/*! Applies one of the prefilters to an 8-bit image.
+  *
+  * \param image Input image of depth CV_8U
+  * \param outputImage Output image of the same size and type
+  * \param type Prefilter to apply
+  */
+void applyPrefilter(const Mat image, Mat& outputImage, Prefilter type);
+
 /*! 2D histogram-based image flattening class. Supports HSV, HLS and YUV colorspaces.
   */
 class ColorHistBackProject : public ProcessingElement{
@@ -222,9 +405,12 @@ protected:
     Mat histogramMask;
     int colorspaceCode;
     Histogram objHistogram;
+    void preprocess8U(const Mat image, Mat* outputImage);
     void preprocess(const Mat image, Mat* outputImage);
 public:
     //bool initialized;
+    /*! Filter applied before the color conversion, PREFILTER_BILATERAL by default*/
+    Prefilter prefilter;
     ColorHistBackProject();
     ColorHistBackProject(int code, const int* histogramSize);
     ColorHistBackProject(int code, const int* histogramSize, String filename);
@@ -259,19 +445,141 @@ public:
     void process(const Mat inputImage, Mat* outputImage);
 };
 
+/*! Horizontal run of pixels [start, end) in a single image row */
+struct PixelRun{
+    int row;
+    int start;
+    int end;
+    PixelRun();
+    PixelRun(int runRow, int runStart, int runEnd);
+    bool operator<(const PixelRun& other) const;
+};
+
+/*! Raw image moments up to second order, accumulated run by run */
+struct BlobMoments{
+    double m00;
+    double m10;
+    double m01;
+    double m20;
+    double m11;
+    double m02;
+    BlobMoments();
+    void add(int row, int start, int end);
+    void add(const BlobMoments& other);
+    void translate(double dx, double dy);
+    Point2f centroid() const;
+    RotatedRect ellipse() const;
+};
+
+/*! Run-length encoded set of pixels. Runs are stored in raster order. */
+class Blob{
+protected:
+    int pixelCount;
+public:
+    std::vector<PixelRun> runs;
+    BlobMoments moments;
+    Blob();
+    void add(int row, int start, int end);
+    void translate(int dx, int dy);
+    void merge(const Blob& other);
+    int area() const;
+    bool empty() const;
+    Rect boundingRect() const;
+    std::vector<Point2i> toPoints() const;
+    void toMask(Mat& mask, uchar value) const;
+};
+
+/*! Hysteresis labeling of runs fed in raster order. Each run is merged with the overlapping runs of the previous row
+    as it arrives, so the runs can come straight from a classification pass without an intermediate
+    image. Buffers are kept between frames. */
+class RunLabeler{
+protected:
+    std::vector<int> runRow;
+    std::vector<int> runStart;
+    std::vector<int> runEnd;
+    std::vector<int> parent;
+    std::vector<char> strong;
+    int currentRow;
+    int rowFirst;
+    int prevFirst;
+    int prevLast;
+    int prevCursor;
+public:
+    /*! Also merge runs touching diagonally, false by default*/
+    bool eightConnected;
+    RunLabeler();
+    /*! Root of element i in a union-find forest, compressing the path on the way */
+    static int findRoot(std::vector<int>& parent, int i);
+    void reset();
+    void addRun(int row, int start, int end, bool isStrong);
+    void label(double minArea, std::vector<Blob>& blobs);
+    /*! Appends the bounding boxes of all components, whether kept by label or not */
+    void supportBounds(std::vector<Rect>& bounds);
+};
+
+/*! \brief Connected components of a binary or probability image.
+  *
+  * Nonzero pixels are labeled in a single pass over their runs with 8-connectivity. Every blob carries its area,
+  * its moments (and thus its centroid) and its bounding box, so no contours are needed. Like external contours,
+  * a blob covers its holes and anything inside them, so nested blobs are not reported and the area includes the
+  * holes. The background runs are labeled in the same pass, and holes are the background components that do not
+  * reach the image border. Blobs whose area lies in the upper half of the range between the smallest and the
+  * largest blob of the frame are kept.
+  */
 class SimpleBlobDetect : public ProcessingElement{
+protected:
+    //foreground and background runs of the last frame, element 0 stands for the background outside the image
+    std::vector<int> runRow;
+    std::vector<int> runStart;
+    std::vector<int> runEnd;
+    std::vector<char> foreground;
+    std::vector<int> parent;
 public:
+    /*! Blobs kept in the last frame, largest first*/
+    std::vector<Blob> blobs;
+    /*! Draw the outlines of the kept blobs in alternating colors, true by default. Otherwise the output is a CV_8U
+      * mask of the kept blobs and the blob list is the main result.*/
+    bool drawBlobs;
     SimpleBlobDetect();
     void process(const Mat inputImage, Mat* outputImage);
 
 };
 
+/*! \brief Motion estimation between consecutive frames.
+  *
+  * The dense mode computes Farneback flow over the whole frame. The sparse mode tracks good features inside a set of
+  * regions, typically the tracked objects, with pyramidal Lucas-Kanade and reports one motion vector per region. The
+  * image pyramid of a frame is built once and reused as the previous pyramid on the next frame. In both modes the
+  * output is a CV_32F image of the L1 motion magnitude; the sparse mode fills each region with its own magnitude.
+  */
 class OpticalFlow : public ProcessingElement{
 protected:
     bool init;
     Mat old;
+    std::vector<Mat> pyramid;
+    std::vector<Mat> oldPyramid;
+    std::vector<Rect> regions;
+    /*! Features of each region in the previous frame */
+    std::vector<std::vector<Point2f> > regionPoints;
+    void processSparse(const Mat gray, Mat* outputImage);
 public:
+    /*! Use sparse Lucas-Kanade tracking instead of dense flow, false by default*/
+    bool sparse;
+    /*! Maximum number of features tracked in a region*/
+    int maxFeatures;
+    /*! Number of pyramid levels above the full resolution image*/
+    int pyramidLevels;
+    /*! Lucas-Kanade window at each pyramid level*/
+    Size windowSize;
+    /*! Median displacement of the features of each region in the last frame*/
+    std::vector<Point2f> regionMotion;
+    /*! Number of features each motion vector was estimated from, 0 if the region had no trackable features*/
+    std::vector<int> regionSupport;
     OpticalFlow();
+    /*! Sets the regions tracked in sparse mode. Without regions the whole frame is a single region.
+      * Features of a region are kept across calls as long as they stay inside it.
+      */
+    void setRegions(const std::vector<Rect>& newRegions);
     void process(const Mat inputImage, Mat* outputImage);
 };
 
@@ -285,6 +593,37 @@ public:
     void process(const Mat inputImage, Mat* outputImage);
 };
 
+/*! \brief Background subtraction with a per-pixel running average and an adaptive threshold.
+  *
+  * The gray level background and its mean absolute deviation are kept in 16-bit fixed point with 7 fractional bits
+  * and updated with a learning rate of 2^-learningShift, 8 pixels at a time with SSE2. A pixel is foreground when it
+  * differs from the background by more than deviationFactor deviations plus minThreshold gray levels. Foreground
+  * pixels are learned 4 times slower, so objects that stop are absorbed gradually instead of at once.
+  * The output and the foreground member are CV_8U masks of the input size.
+  */
+class RunningAvgBGSubtractor : public ProcessingElement{
+protected:
+    Mat background;
+    Mat deviation;
+    void updateRow(const uchar* gray, short* bg, short* dev, uchar* fg, int width);
+public:
+    /*! Model the background at half resolution, true by default*/
+    bool halfResolution;
+    /*! Background learning rate as a power of two, 5 by default (1/32)*/
+    int learningShift;
+    /*! Number of mean absolute deviations a foreground pixel has to differ by, 3 by default*/
+    int deviationFactor;
+    /*! Minimum gray level difference of a foreground pixel, 10 by default*/
+    int minThreshold;
+    /*! Use the SSE2 update where available, true by default. The scalar update gives identical results.*/
+    bool vectorized;
+    /*! Foreground mask of the last frame, usable as a gate by other elements*/
+    Mat foreground;
+    RunningAvgBGSubtractor();
+    void reset();
+    void process(const Mat inputImage, Mat* outputImage);
+};
+
 #endif
 
 
@@ -7,28 +7,81 @@
 #include "boost/smart_ptr.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread/thread_time.hpp>
+#include <boost/thread.hpp>
 #include <boost/ref.hpp>
 #include "ImgProcPipeline.hpp"
+#include "Geometry.hpp"
 #include "GestureRecognition.hpp"
 #include <ctime>
 
 using namespace std;
 using namespace cv;
 
+/*! Background worker refitting the online GMM of an UpdatableHistogram, shared by its copies.
+  * The refit warm-starts from the last fitted model and runs a few EM iterations on the latest aposteriori histogram.
+  * A single thread lives as long as the object; destruction waits for a refit in progress to finish.
+  */
+class GMMRefit{
+protected:
+    boost::condition_variable wake;
+    bool stopping;
+    //histogram waiting to be fitted, empty when there is nothing to do
+    Mat pending;
+    boost::thread worker;
+    void run();
+public:
+    boost::mutex lock;
+    bool running;
+    bool resultReady;
+    int iterations;
+    int histSize[2];
+    float c1range[2];
+    float c2range[2];
+    GaussianMixtureModel gmm;
+    Mat result;
+    GMMRefit(int histogramSize[2], float channel1range[2], float channel2range[2]);
+    ~GMMRefit();
+    //queues a refit, the caller holds lock and the worker must not be running
+    void start(Mat histogram);
+};
+
 class UpdatableHistogram : public Histogram{
 protected:
     int buffersize;
     vector<Mat> buffer;
+    vector<char> bufferValid;
+    Mat bufferSum;
+    int bufferHead;
+    int bufferValidCount;
     Mat offline;
+    int onlineGMMIterations;
+    boost::shared_ptr<GMMRefit> refit;
+    Mat onlineGMM;
+    Mat colorLookupSource;
+    Mat colorLookup;
+    void refitOnline(const Mat aposteriori);
 public:
     UpdatableHistogram();
     UpdatableHistogram(int channels[2], int histogramSize[2], float channel1range[2], float channel2range[2], int bufferSize);
+    void setOnlineGMM(int iterations);
+    bool updateColorLookup(const ColorQuantizer& quantizer, double tolerance);
+    //8-bit probability of each quantized color cell, as of the last updateColorLookup
+    const Mat& getColorLookup() const;
     void update(Mat image, double alpha, const Mat mask);
+    void update(const Mat objectHist, const Mat apriori, double alpha);
     void fromImage(const vector<Mat> image, const vector<Mat> mask);
     void toImage(std::string rootPath);
     bool fromStored(std::string rootPath);
 };
 
+/*! Span of a rasterized object ellipse within one image row */
+struct ObjectSpan{
+    int object;
+    int start;
+    int end;
+    ObjectSpan(int spanObject, int spanStart, int spanEnd);
+};
+
 class TrackedObject{
     protected:
         Size imageSize;
@@ -42,23 +95,35 @@ class TrackedObject{
         Scalar color;
         vector<boost::shared_ptr<TrackedObject> > occluding;
         vector<boost::shared_ptr<TrackedObject> > occluders;
-        vector<Point2i> points;
+        BlobMoments moments;
+        //runs of the last labeled blob, only kept for the debug contour
+        Blob blob;
         vector<Point> contour;
         RotatedRect ellipse;
         RotatedRect actualEllipse;
         float area;
-        Point2f estMove;
+        KalmanFilter motion;
+        //covariance of the predicted state [cx, cy, width, height, angle, velocities...]
+        Mat predictedCovariance;
         TrackedObject();
-        TrackedObject(const Mat image, const vector<Point> inContour, bool isContour);
+        TrackedObject(const Mat image, const Blob& inBlob);
 	
 
         vector<Point> pointsFromContour();
-        void update(const Mat image, const vector<Point> inContour, bool isContour);
+        void updateContour();
+        void update(const Mat image, const Blob& inBlob);
+        void update(const RotatedRect& newEllipse);
+        void initMotion(const RotatedRect& measured);
+        void correctMotion(const RotatedRect& measured);
+        void coastMotion();
+        void predictMotion();
+        double gateDistance(const BlobMoments& measured);
+        Rect searchWindow(double padding, double sigmas);
         void updateArea();
         double getAreaRatio(double compareArea);
         double getArea();
         RotatedRect getEllipse();
-        RotatedRect useCamShift(const Mat probImage);
+        RotatedRect useCamShift(const Mat probImage, Point2i offset);
         double compare(boost::shared_ptr<TrackedObject> otherObject);
         void unOcclude();
         void updateTrajectory(Point2f pt, long long time);
@@ -70,15 +135,55 @@ class ObjectTracker : public ProcessingElement{
     protected:
     int frameNumber;
     int nextObjectIdx;
+    ColorQuantizer quantizer;
+    Mat kindLookup;
+    vector<RunLabeler> labelers;
+    int lastFullScan;
+    bool trackLost;
+    //frame the cached blobs were segmented from, block by block. Kept across ROI frames, which leave the cache alone
+    Mat motionReference;
+    //gated full scans since the reference was last taken whole
+    int gatedScans;
+    vector<Blob> cachedBlobs;
+    vector<int> cachedBlobKinds;
+    //bounding boxes of all low threshold components of the cached segmentation, with or without a strong pixel
+    vector<Rect> cachedSupport;
+    void trackingWindows(Size imageSize, vector<Rect>& windows, bool merge);
+    bool camShiftObjects(const Mat inputImage, vector<RotatedRect>& results);
+    bool motionWindows(const Mat inputImage, vector<Rect>& windows, vector<Blob>& blobs, vector<int>& blobKinds);
+    void frameHistogram(const Mat index, Mat& hist, int budget, int phase);
+    void blobHistogram(const Mat index, const vector<Blob>& blobs, Mat& hist, int budget, int phase);
+    void updateKindLookup();
+    void segmentWindow(const Mat image, Mat& index, vector<vector<Blob> >& kindBlobs, double lowThresh, double hiThresh, double minArea);
     public:
     vector<UpdatableHistogram> objectKinds;
     objMap objects;
     //vector<boost::shared_ptr<TrackedObject> > objects;
     vector<RotatedRect> lastFrameBlobs;
     vector<int> largestObjOfKind;
+    int onlineGMMIterations;
+    //segment only padded windows around the tracked objects between full frame scans
+    bool useROI;
+    int fullScanInterval;
+    //padding added on each side of a window, relative to the object's bounding box, on top of the motion uncertainty
+    double roiPadding;
+    //size of the association and search gates in standard deviations of the predicted state
+    double gateSigmas;
+    //follow well separated objects with CamShift on ROI frames instead of segmenting them
+    bool useCamShift;
+    //maximum number of pixels sampled for each histogram of the online update, 0 counts every pixel
+    int histogramPixelBudget;
+    //on full scans only resegment blocks where a color channel changed and reuse the blobs of the static parts.
+    //With useROI the comparison is against the last full scan
+    bool useMotionGate;
+    int motionBlockSize;
+    //difference of a color channel counted as a change
+    int motionThreshold;
 	ObjectTracker();
+    void setOnlineGMM(int iterations);
     void preprocess(const Mat image, Mat& outputImage, Mat& mask);
-    void getProbImages(const Mat procimg, const Mat mask, vector<Mat>& outputImages);
+    void getProbImages(const Mat index, vector<Mat>& outputImages);
+    void getProbImage(const Mat index, int kind, Mat& outputImage);
 	void process(const Mat inputImage, Mat* outputImage);
     bool addObjectKind(const vector<Mat> image, const vector<Mat> outMask);
     bool addObjectKind(const vector<Mat> image, const vector<Mat> outMask, std::string path);
@@ -95,7 +200,9 @@ double distRotatedRect(RotatedRect r1, RotatedRect r2);
 
 void occludeBy(boost::shared_ptr<TrackedObject> underObject, boost::shared_ptr<TrackedObject> overObject);
 
-void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector < std::vector<cv::Point2i> > &blobs, double lowThresh, double hiThresh);
+void hungarianAssignment(const std::vector<double>& cost, int rows, int cols, std::vector<int>& assignment);
+
+void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector<Blob> &blobs, double lowThresh, double hiThresh, double minArea);
 
 
 #endif
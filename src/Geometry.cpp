@@ -0,0 +1,202 @@
+#include "Geometry.hpp"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+
+EllipseTransform::EllipseTransform(): center(0,0), cosA(1), sinA(0), invA(0), invB(0), valid(false), qa(0), qb(0), qc(0){}
+
+EllipseTransform::EllipseTransform(const RotatedRect& ellipse){
+    center = ellipse.center;
+    double ang = - ellipse.angle / 180.0 *  3.141592653589;
+    double c = cos(ang);
+    double s = sin(ang);
+    cosA = c;
+    sinA = s;
+    double a = ellipse.size.width/2.0;
+    double b = ellipse.size.height/2.0;
+    valid = a>0 && b>0;
+    if (!valid){
+        invA = 0;
+        invB = 0;
+        qa = 0;
+        qb = 0;
+        qc = 0;
+        return;
+    }
+    invA = 1.0/a;
+    invB = 1.0/b;
+    qa = c*c/(a*a)+s*s/(b*b);
+    qb = 2.0*c*s*(1.0/(b*b)-1.0/(a*a));
+    qc = s*s/(a*a)+c*c/(b*b);
+}
+
+void EllipseTransform::rowDistances(int row, int start, int end, float* distances) const{
+    if (!valid){
+        std::fill(distances, distances+std::max(0, end-start), FLT_MAX);
+        return;
+    }
+    float dy = row-center.y;
+    //the row offset is shared by all pixels, only the x terms vary
+    float uy = -sinA*dy;
+    float vy = cosA*dy;
+    int count = end-start;
+    int i = 0;
+#ifdef __SSE2__
+    __m128 c = _mm_set1_ps(cosA);
+    __m128 s = _mm_set1_ps(sinA);
+    __m128 ia = _mm_set1_ps(invA);
+    __m128 ib = _mm_set1_ps(invB);
+    __m128 uyv = _mm_set1_ps(uy);
+    __m128 vyv = _mm_set1_ps(vy);
+    __m128 step = _mm_set1_ps(4.0f);
+    __m128 dx = _mm_sub_ps(_mm_setr_ps(start, start+1, start+2, start+3), _mm_set1_ps(center.x));
+    for (; i+4<=count; i+=4){
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(c, dx), uyv), ia);
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(s, dx), vyv), ib);
+        _mm_storeu_ps(distances+i, _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v)));
+        dx = _mm_add_ps(dx, step);
+    }
+#endif
+    for (; i<count; i++){
+        float dx = start+i-center.x;
+        float u = (cosA*dx+uy)*invA;
+        float v = (sinA*dx+vy)*invB;
+        distances[i] = u*u+v*v;
+    }
+}
+
+bool EllipseTransform::rowSpan(int row, int width, int& start, int& end) const{
+    if (!valid){
+        return false;
+    }
+    double dy = row-center.y;
+    double lin = qb*dy;
+    double disc = lin*lin-4.0*qa*(qc*dy*dy-1.0);
+    if (disc<=0){
+        return false;
+    }
+    double root = sqrt(disc);
+    start = std::max(0, cvFloor(center.x+(-lin-root)/(2.0*qa))+1);
+    end = std::min(width, cvCeil(center.x+(-lin+root)/(2.0*qa)));
+    return start<end;
+}
+
+void EllipseTransform::rowRange(int height, int& top, int& bottom) const{
+    if (!valid){
+        top = 0;
+        bottom = -1;
+        return;
+    }
+    double yExtent = sqrt(qa/(qa*qc-0.25*qb*qb));
+    top = std::max(0, cvFloor(center.y-yExtent));
+    bottom = std::min(height-1, cvCeil(center.y+yExtent));
+}
+
+OrientedBox::OrientedBox(){
+    for (int i=0; i<4; i++){
+        cornerX[i] = 0;
+        cornerY[i] = 0;
+        edgeX[i] = 0;
+        edgeY[i] = 0;
+        invEdgeLengthSq[i] = 0;
+    }
+    axes[0] = Point2f(1,0);
+    axes[1] = Point2f(0,1);
+    minProj[0] = minProj[1] = 0;
+    maxProj[0] = maxProj[1] = 0;
+}
+
+OrientedBox::OrientedBox(const RotatedRect& box){
+    Point2f corners[4];
+    box.points(corners);
+    for (int i=0; i<4; i++){
+        cornerX[i] = corners[i].x;
+        cornerY[i] = corners[i].y;
+    }
+    for (int i=0; i<4; i++){
+        edgeX[i] = cornerX[(i+1)%4]-cornerX[i];
+        edgeY[i] = cornerY[(i+1)%4]-cornerY[i];
+        float lengthSq = edgeX[i]*edgeX[i]+edgeY[i]*edgeY[i];
+        invEdgeLengthSq[i] = lengthSq>0 ? 1.0f/lengthSq : 0.0f;
+    }
+    double ang = -box.angle/180.0*3.1415927;
+    axes[0] = Point2f(cos(ang), -sin(ang));
+    axes[1] = Point2f(sin(ang), cos(ang));
+    project(axes[0], minProj[0], maxProj[0]);
+    project(axes[1], minProj[1], maxProj[1]);
+}
+
+void OrientedBox::project(Point2f axis, float& minimum, float& maximum) const{
+    minimum = FLT_MAX;
+    maximum = -FLT_MAX;
+    for (int i=0; i<4; i++){
+        float p = axis.x*cornerX[i]+axis.y*cornerY[i];
+        minimum = std::min(minimum, p);
+        maximum = std::max(maximum, p);
+    }
+}
+
+bool OrientedBox::intersects(const OrientedBox& other) const{
+    float minOther, maxOther;
+    for (int i=0; i<2; i++){
+        other.project(axes[i], minOther, maxOther);
+        if (minProj[i]>maxOther || minOther>maxProj[i]){
+            return false;
+        }
+        float minOwn, maxOwn;
+        project(other.axes[i], minOwn, maxOwn);
+        if (minOwn>other.maxProj[i] || other.minProj[i]>maxOwn){
+            return false;
+        }
+    }
+    return true;
+}
+
+float OrientedBox::cornerToEdgeDistanceSq(const OrientedBox& other) const{
+#ifdef __SSE2__
+    //all four edges of the other box are tested against one corner at a time
+    __m128 ax = _mm_loadu_ps(other.cornerX);
+    __m128 ay = _mm_loadu_ps(other.cornerY);
+    __m128 ex = _mm_loadu_ps(other.edgeX);
+    __m128 ey = _mm_loadu_ps(other.edgeY);
+    __m128 il = _mm_loadu_ps(other.invEdgeLengthSq);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    for (int i=0; i<4; i++){
+        __m128 wx = _mm_sub_ps(_mm_set1_ps(cornerX[i]), ax);
+        __m128 wy = _mm_sub_ps(_mm_set1_ps(cornerY[i]), ay);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(wx, ex), _mm_mul_ps(wy, ey)), il);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 rx = _mm_sub_ps(wx, _mm_mul_ps(t, ex));
+        __m128 ry = _mm_sub_ps(wy, _mm_mul_ps(t, ey));
+        best = _mm_min_ps(best, _mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)));
+    }
+    best = _mm_min_ps(best, _mm_shuffle_ps(best, best, _MM_SHUFFLE(1,0,3,2)));
+    best = _mm_min_ps(best, _mm_shuffle_ps(best, best, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtss_f32(best);
+#else
+    float best = FLT_MAX;
+    for (int i=0; i<4; i++){
+        for (int j=0; j<4; j++){
+            float wx = cornerX[i]-other.cornerX[j];
+            float wy = cornerY[i]-other.cornerY[j];
+            float t = (wx*other.edgeX[j]+wy*other.edgeY[j])*other.invEdgeLengthSq[j];
+            t = std::min(std::max(t, 0.0f), 1.0f);
+            float rx = wx-t*other.edgeX[j];
+            float ry = wy-t*other.edgeY[j];
+            best = std::min(best, rx*rx+ry*ry);
+        }
+    }
+    return best;
+#endif
+}
+
+float OrientedBox::distance(const OrientedBox& other) const{
+    return sqrt(std::min(cornerToEdgeDistanceSq(other), other.cornerToEdgeDistanceSq(*this)));
+}
@@ -4,6 +4,10 @@
 #include "ImgProcPipeline.hpp"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace cv;
 
@@ -83,10 +87,76 @@ void Histogram::backPropagate(Mat inputImage, Mat* outputImage){
     outputImage->convertTo(*outputImage, CV_32FC1);
 }
 
+void Histogram::makeBinLookup(int dim, int lut[256]){
+    const float* range = dim==0 ? c1range : c2range;
+    double scale = histSize[dim]/(range[1]-range[0]);
+    for (int v=0; v<256; v++){
+        int bin = cvFloor((v-range[0])*scale);
+        if (v<range[0] || v>=range[1] || bin<0 || bin>=histSize[dim]){
+            lut[v] = -1;
+        }
+        else {
+            lut[v] = bin;
+        }
+    }
+}
+
+void Histogram::backPropagate8U(const Mat inputImage, Mat* outputImage){
+    CV_Assert(inputImage.depth()==CV_8U);
+    int bin1[256];
+    int bin2[256];
+    makeBinLookup(0, bin1);
+    makeBinLookup(1, bin2);
+    //fold the row stride of the table into the first lookup, invalid bins become negative offsets
+    for (int v=0; v<256; v++){
+        bin1[v] = bin1[v]<0 ? -histSize[0]*histSize[1] : bin1[v]*histSize[1];
+        bin2[v] = bin2[v]<0 ? -histSize[0]*histSize[1] : bin2[v];
+    }
+    Mat table;
+    normalized.convertTo(table, CV_8U, 255.0);
+    const uchar* tab = table.ptr<uchar>(0);
+
+    outputImage->create(inputImage.size(), CV_8UC1);
+    int cn = inputImage.channels();
+    int ch1 = channels[0];
+    int ch2 = channels[1];
+    for (int y=0; y<inputImage.rows; y++){
+        const uchar* src = inputImage.ptr<uchar>(y);
+        uchar* dst = outputImage->ptr<uchar>(y);
+        for (int x=0; x<inputImage.cols; x++){
+            int idx = bin1[src[ch1]]+bin2[src[ch2]];
+            dst[x] = idx>=0 ? tab[idx] : 0;
+            src += cn;
+        }
+    }
+}
+
+void Histogram::binIndex(const Mat inputImage, Mat* outputImage){
+    CV_Assert(inputImage.depth()==CV_8U);
+    int bin1[256];
+    int bin2[256];
+    makeBinLookup(0, bin1);
+    makeBinLookup(1, bin2);
+    outputImage->create(inputImage.size(), CV_32SC1);
+    int cn = inputImage.channels();
+    int ch1 = channels[0];
+    int ch2 = channels[1];
+    for (int y=0; y<inputImage.rows; y++){
+        const uchar* src = inputImage.ptr<uchar>(y);
+        int* dst = outputImage->ptr<int>(y);
+        for (int x=0; x<inputImage.cols; x++){
+            int b1 = bin1[src[ch1]];
+            int b2 = bin2[src[ch2]];
+            dst[x] = (b1<0 || b2<0) ? -1 : b1*histSize[1]+b2;
+            src += cn;
+        }
+    }
+}
+
 void Histogram::makeGMM(int K, int maxIter = 10, double minStepIncrease = 0.01){
     gmm = GaussianMixtureModel(2,K);
     accumulator.convertTo(normalized, CV_64F);
-    gmm.fromHistogram(normalized, histSize, c1range, c2range, maxIter, minStepIncrease);
+    gmm.fromHistogram(normalized, histSize, c1range, c2range, maxIter, minStepIncrease, false);
     gmmReady = true;
     
     Mat hist = gmm.lookup;
@@ -102,6 +172,25 @@ void Histogram::resize(int histogramSize[2]){
 }
 
 
+template<> void GaussianKernel<2>::set(const Mat& meanVector, const Mat& covarianceMatrix){
+    double a = covarianceMatrix.at<double>(0,0);
+    double b = 0.5*(covarianceMatrix.at<double>(0,1)+covarianceMatrix.at<double>(1,0));
+    double c = covarianceMatrix.at<double>(1,1);
+    double det = a*c-b*b;
+    valid = det>1e-300;
+    if (!valid){
+        return;
+    }
+    mean[0] = meanVector.at<double>(0,0);
+    mean[1] = meanVector.at<double>(1,0);
+    inverseCovariance[0][0] = c/det;
+    inverseCovariance[0][1] = -b/det;
+    inverseCovariance[1][0] = -b/det;
+    inverseCovariance[1][1] = a/det;
+    logNormalization = -std::log(2*CV_PI)-0.5*std::log(det);
+}
+
+
 GaussianMixtureModel::GaussianMixtureModel(){
     initialized = false;
 }
@@ -120,6 +209,7 @@ GaussianMixtureModel::GaussianMixtureModel(int dims, int K){
         weight.push_back(1.0/K);
     }
     initialized = false;
+    updateKernels();
 }
 
 GaussianMixtureModel::GaussianMixtureModel(const GaussianMixtureModel& other){
@@ -139,8 +229,8 @@ GaussianMixtureModel::GaussianMixtureModel(const GaussianMixtureModel& other){
         other.meanVector[i].copyTo(temp);
         meanVector.push_back(temp);
     }
-    other.componentProbability.copyTo(componentProbability);
     other.lookup.copyTo(lookup);
+    kernel2D = other.kernel2D;
 }
 
 GaussianMixtureModel& GaussianMixtureModel::operator=(const GaussianMixtureModel& other){
@@ -161,151 +251,203 @@ GaussianMixtureModel& GaussianMixtureModel::operator=(const GaussianMixtureModel
             other.meanVector[i].copyTo(temp);
             meanVector.push_back(temp);
         }
-        other.componentProbability.copyTo(componentProbability);
         other.lookup.copyTo(lookup);
+        kernel2D = other.kernel2D;
     }
     
     return *this;
 }
 
-/* matrix samples is a N X (M+1) matrix, consisting of N M-dimensional samples. The last row-element is the number of identical samples*/
-void GaussianMixtureModel::runExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease){
-    if (true){
-        //componentProbability = Mat::ones(samples.rows, components, CV_64F)/(1.0*components);
-        initialized = true;
-
-        int k = 0;
-        int numEach = samples.rows / components;
-        double num = 0;
-        Mat tempVec = Mat::zeros(dimensions, 1, CV_64F);
-        meanVector.clear();
-        for (int i=0; i<samples.rows; i++){
-            double element = samples.at<double>(i,dimensions);
-            Mat elementx = samples(Range(i,i+1),Range(0,dimensions));
-            elementx = elementx.t();
-            tempVec += element * elementx;
-            num += element;
-            if (i!=0 && i%numEach==0){
-                meanVector.push_back(tempVec/num);
-                num=0;
-                tempVec = Mat::zeros(dimensions, 1, CV_64F);
-                k++;
-            }
-        }
-        meanVector.push_back(tempVec/num);
+void GaussianMixtureModel::updateKernels(){
+    kernel2D.clear();
+    if (dimensions!=2){
+        return;
     }
-    
-    double increase = 0;
-    double lastLogLikelihood = 0;
-    bool start = true;
-    double nDataPoints = 0;
-    for (int i=0; i<samples.rows; i++){
-        nDataPoints+=samples.at<double>(i,dimensions);
+    kernel2D.resize(components);
+    for (int k=0; k<components; k++){
+        kernel2D[k].set(meanVector[k], covarianceMatrix[k]);
     }
-    
-    std::vector<double> newWeight;
-    std::vector<Mat> newCovarianceMatrix;
-    std::vector<Mat> newMeanVector;
-    Mat newComponentProbability;
-    
-    for (int step = 0; step<maxIterations; step++){
-
-        newCovarianceMatrix.clear();
-        newMeanVector.clear();
-        newWeight.clear();
+}
 
-        for (int i = 0; i<components; i++){
-            newCovarianceMatrix.push_back(Mat::zeros(dimensions, dimensions, CV_64F));
-            newMeanVector.push_back(Mat::zeros(dimensions, 1, CV_64F));
-            newWeight.push_back(0.0);
+void GaussianMixtureModel::initializeMeans(const Mat samples){
+    int numEach = std::max(1, samples.rows / components);
+    meanVector.clear();
+    for (int k=0; k<components; k++){
+        int start = std::min(k*numEach, samples.rows-1);
+        int end = std::min(start+numEach, samples.rows);
+        if (k==components-1){
+            end = samples.rows;
         }
-        newComponentProbability = Mat::zeros(samples.rows, components+1, CV_64F);
-
-        for (int i = 0; i<samples.rows; i++){
-            Mat elementx = samples(Range(i,i+1),Range(0,dimensions));
-            elementx = elementx.t();
-            for (int k = 0; k<components; k++){
-                double prob = weight[k]*gaussIdx(elementx, k);
-                newComponentProbability.at<double>(i,k) = prob;
+        Mat tempVec = Mat::zeros(dimensions, 1, CV_64F);
+        double num = 0;
+        for (int i=start; i<end; i++){
+            const double* x = samples.ptr<double>(i);
+            for (int d=0; d<dimensions; d++){
+                tempVec.at<double>(d,0) += x[dimensions]*x[d];
             }
+            num += x[dimensions];
         }
+        if (num>0){
+            tempVec /= num;
+        }
+        meanVector.push_back(tempVec);
+    }
+}
 
-        //std::cout << "Compprob: "<< newComponentProbability << std::endl;
-
-
-        for (int i = 0; i<samples.rows; i++){
-            double sum = 0;
-            const double* tempRow = newComponentProbability.ptr<double>(i);
-            for (int k = 0; k<components; k++){
-                sum += tempRow[k];
-            }
-            if (sum>1e-300){
-                Mat rowMod = newComponentProbability.row(i);
-                rowMod /= sum;
-            }
-            else {
-                for (int k = 0; k<components; k++){
-                    newComponentProbability.at<double>(i,k)=1.0/components;
+/*! Parallel body of a fused EM iteration over a range of sample stripes.
+  * For each stripe, the E-step responsibilities of every sample are computed and immediately accumulated into the
+  * sufficient statistics of each component: the total responsibility, the first moment and the second moment, followed by
+  * the log likelihood of the stripe. The moments are taken about the component's current mean, so that the covariance
+  * of a tight cluster far from the origin does not cancel out in the M-step. Statistics of component k start at offset k*(1+N+N*N) of the stripe's partial vector,
+  * and the log likelihood is the last element.
+  */
+template<int N>
+class ExpectationMaximizationBody : public ParallelLoopBody{
+    const Mat& samples;
+    const std::vector<GaussianKernel<N> >& kernel;
+    const std::vector<double>& weight;
+    const std::vector<double>& center;
+    std::vector<std::vector<double> >& partial;
+    int stripeSize;
+public:
+    ExpectationMaximizationBody(const Mat& inSamples, const std::vector<GaussianKernel<N> >& inKernel, const std::vector<double>& inWeight,
+                                const std::vector<double>& inCenter, std::vector<std::vector<double> >& outPartial, int inStripeSize)
+        : samples(inSamples), kernel(inKernel), weight(inWeight), center(inCenter), partial(outPartial), stripeSize(inStripeSize) {}
+
+    void operator()(const Range& range) const{
+        int components = kernel.size();
+        int statSize = 1+N+N*N;
+        std::vector<double> prob(components);
+        for (int stripe=range.start; stripe<range.end; stripe++){
+            std::vector<double>& acc = partial[stripe];
+            std::fill(acc.begin(), acc.end(), 0.0);
+            int last = std::min((stripe+1)*stripeSize, samples.rows);
+            for (int i=stripe*stripeSize; i<last; i++){
+                const double* x = samples.ptr<double>(i);
+                double sum = 0;
+                for (int k=0; k<components; k++){
+                    prob[k] = weight[k]*kernel[k].density(x);
+                    sum += prob[k];
+                }
+                if (sum>1e-300){
+                    for (int k=0; k<components; k++){
+                        prob[k] /= sum;
+                    }
+                    acc[components*statSize] += x[N]*std::log(sum);
+                }
+                else {
+                    for (int k=0; k<components; k++){
+                        prob[k] = 1.0/components;
+                    }
+                    acc[components*statSize] += x[N]*std::log(1e-300);
+                }
+                for (int k=0; k<components; k++){
+                    double r = x[N]*prob[k];
+                    double* stat = &acc[k*statSize];
+                    const double* c = &center[k*N];
+                    stat[0] += r;
+                    for (int a=0; a<N; a++){
+                        double rx = r*(x[a]-c[a]);
+                        stat[1+a] += rx;
+                        for (int b=0; b<N; b++){
+                            stat[1+N+a*N+b] += rx*(x[b]-c[b]);
+                        }
+                    }
                 }
             }
         }
+    }
+};
 
-        newComponentProbability.copyTo(componentProbability);
+/* matrix samples is a N X (M+1) matrix, consisting of N M-dimensional samples. The last row-element is the number of identical samples*/
+template<int N>
+void GaussianMixtureModel::runFixedExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease){
+    std::vector<GaussianKernel<N> > kernel(components);
+    for (int k=0; k<components; k++){
+        kernel[k].set(meanVector[k], covarianceMatrix[k]);
+    }
 
-        //std::cout << "Compprob: "<< newComponentProbability << std::endl;
+    double nDataPoints = 0;
+    for (int i=0; i<samples.rows; i++){
+        nDataPoints += samples.ptr<double>(i)[N];
+    }
 
+    //stripes depend only on the number of samples, so the reduction order and the result do not depend on the thread count
+    const int stripeSize = 256;
+    int stripes = (samples.rows+stripeSize-1)/stripeSize;
+    int statSize = 1+N+N*N;
+    std::vector<std::vector<double> > partial(stripes, std::vector<double>(components*statSize+1));
+    std::vector<double> total(components*statSize+1);
+    std::vector<double> center(components*N);
+    double lastLogLikelihood = 0;
 
-        for (int i = 0; i<samples.rows; i++){
-            double element = samples.at<double>(i,dimensions);
-            Mat elementx = samples(Range(i,i+1),Range(0,dimensions));
-            elementx = elementx.t();
-            for (int k = 0; k<components; k++){
-                double prob = componentProbability.at<double>(i,k);
-                newWeight[k] += element * prob;
-                newMeanVector[k] += element * elementx * prob;
+    for (int step = 0; step<maxIterations; step++){
+        for (int k=0; k<components; k++){
+            for (int a=0; a<N; a++){
+                center[k*N+a] = meanVector[k].at<double>(a,0);
             }
         }
+        parallel_for_(Range(0, stripes), ExpectationMaximizationBody<N>(samples, kernel, weight, center, partial, stripeSize));
 
-        for (int k = 0; k<components; k++){
-            newMeanVector[k] /= newWeight[k];
-            newWeight[k] /= 1.0 * nDataPoints;
-        }
-        for (int i = 0; i<samples.rows; i++){
-            double element = samples.at<double>(i,dimensions);
-            Mat elementx = samples(Range(i,i+1),Range(0,dimensions));
-            elementx = elementx.t();
-            for (int k = 0; k<components; k++){
-                double prob = componentProbability.at<double>(i,k);
-                Mat diff = (elementx - newMeanVector[k]);
-                newCovarianceMatrix[k] += element * prob * diff*diff.t();
+        std::fill(total.begin(), total.end(), 0.0);
+        for (int s=0; s<stripes; s++){
+            for (int j=0; j<total.size(); j++){
+                total[j] += partial[s][j];
             }
         }
 
-        for (int k = 0; k<components; k++){
-            newCovarianceMatrix[k] /= 1.0*nDataPoints * newWeight[k];
+        double logLikelihood = total[components*statSize];
+        if (step>0 && logLikelihood-lastLogLikelihood < minStepIncrease*std::abs(lastLogLikelihood)){
+            break;
         }
+        lastLogLikelihood = logLikelihood;
 
-        for (int k = 0; k<components; k++){
-            weight[k] = newWeight[k];
-            newMeanVector[k].copyTo(meanVector[k]);
-            newCovarianceMatrix[k].copyTo(covarianceMatrix[k]);
+        for (int k=0; k<components; k++){
+            const double* stat = &total[k*statSize];
+            //a component which lost all of its data points keeps its previous parameters
+            if (stat[0]<=1e-300){
+                continue;
+            }
+            weight[k] = stat[0]/nDataPoints;
+            //the first moment is the shift of the mean, small compared to the spread of the cluster
+            double shift[N];
+            for (int a=0; a<N; a++){
+                shift[a] = stat[1+a]/stat[0];
+                meanVector[k].at<double>(a,0) = center[k*N+a]+shift[a];
+            }
+            for (int a=0; a<N; a++){
+                for (int b=0; b<N; b++){
+                    covarianceMatrix[k].at<double>(a,b) = stat[1+N+a*N+b]/stat[0] - shift[a]*shift[b];
+                }
+            }
+            kernel[k].set(meanVector[k], covarianceMatrix[k]);
         }
+    }
+}
 
-        double logLikelihood = 0.0;
-        for (int i=0; i<samples.rows; i++){
-            int element = samples.at<int>(i,dimensions);
-            Mat elementx = samples.rowRange(0, dimensions);
-            elementx = elementx.t();
-            double prob = get(elementx);
-            logLikelihood += element * prob;
-        }
-        if (!start){
-            increase = logLikelihood/lastLogLikelihood;
-            if (increase < (1+minStepIncrease)) {break;}
-        }
-        start = false;
-        lastLogLikelihood = logLikelihood;
+void GaussianMixtureModel::runExpectationMaximization(const Mat samples, int maxIterations, double minStepIncrease, bool warmStart = false){
+    if (samples.rows==0){
+        return;
+    }
+    if (!warmStart || !initialized){
+        initializeMeans(samples);
     }
+
+    switch (dimensions){
+    case 1:
+        runFixedExpectationMaximization<1>(samples, maxIterations, minStepIncrease); break;
+    case 2:
+        runFixedExpectationMaximization<2>(samples, maxIterations, minStepIncrease); break;
+    case 3:
+        runFixedExpectationMaximization<3>(samples, maxIterations, minStepIncrease); break;
+    case 4:
+        runFixedExpectationMaximization<4>(samples, maxIterations, minStepIncrease); break;
+    default:
+        std::cout << "EM is not supported for " << dimensions << "-dimensional models" << std::endl;
+        return;
+    }
+    initialized = true;
+    updateKernels();
 }
 
 double GaussianMixtureModel::gauss(const Mat x, Mat covMatrix, Mat meanVec){
@@ -337,6 +479,13 @@ double GaussianMixtureModel::gaussIdx(const Mat x, int componentIndex){
 
 double GaussianMixtureModel::get(Mat x){
     double retVal = 0;
+    if (kernel2D.size()==components && x.size()==Size(1,2)){
+        double xarr[] = {x.at<double>(0,0), x.at<double>(1,0)};
+        for (int k=0; k<components; k++){
+            retVal += weight[k]*kernel2D[k].density(xarr);
+        }
+        return retVal;
+    }
     for (int k=0; k<components; k++){
         double prob = weight[k]*gaussIdx(x, k);
         if (prob<0) {return -1;}
@@ -346,16 +495,45 @@ double GaussianMixtureModel::get(Mat x){
 }
 
 void GaussianMixtureModel::makeLookup(int histSize[2], float c1range[2], float c2range[2]){
+    if (kernel2D.size()!=components){
+        updateKernels();
+    }
+    if (dimensions!=2){
+        return;
+    }
     Mat newLookup(histSize[0], histSize[1], CV_64F);
     float dim1step = (c1range[1]-c1range[0])/(1.0*histSize[0]);
     float dim2step = (c2range[1]-c2range[0])/(1.0*histSize[1]);
     float dim1start = c1range[0]+dim1step/2.0;
     float dim2start = c2range[0]+dim2step/2.0;
+    std::vector<double> dim2value(histSize[1]);
+    for (int j=0; j<histSize[1]; j++){
+        dim2value[j] = dim2start+j*dim2step;
+    }
+    //exponents of a whole row are evaluated first and exponentiated together
+    Mat exponent(1, histSize[1], CV_64F);
+    double* expRow = exponent.ptr<double>(0);
     for (int i=0; i<histSize[0]; i++){
-        for (int j=0; j<histSize[1]; j++){
-            double xarr[] = {dim1start+i*dim1step, dim2start+j*dim2step};
-            Mat x(2,1,CV_64F, xarr);
-            newLookup.at<double>(i,j)=get(x);
+        Mat row = newLookup.row(i);
+        row.setTo(Scalar(0));
+        double x0 = dim1start+i*dim1step;
+        for (int k=0; k<components; k++){
+            const GaussianKernel<2>& kernel = kernel2D[k];
+            if (!kernel.valid || weight[k]<=0){
+                continue;
+            }
+            //the quadratic form is split into a per-row constant and a polynomial in the second coordinate
+            double d0 = x0-kernel.mean[0];
+            double c0 = std::log(weight[k])+kernel.logNormalization-0.5*kernel.inverseCovariance[0][0]*d0*d0;
+            double c1 = -kernel.inverseCovariance[0][1]*d0;
+            double c2 = -0.5*kernel.inverseCovariance[1][1];
+            double m1 = kernel.mean[1];
+            for (int j=0; j<histSize[1]; j++){
+                double d1 = dim2value[j]-m1;
+                expRow[j] = c0+d1*(c1+c2*d1);
+            }
+            exp(exponent, exponent);
+            row += exponent;
         }
     }
     newLookup=newLookup*dim1step*dim2step;
@@ -366,7 +544,7 @@ void GaussianMixtureModel::makeLookup(int histSize[2], float c1range[2], float c
     lookup.convertTo(lookup,CV_64F,1/(histMax-histMin),-histMin/(histMax-histMin));
 }
 
-void GaussianMixtureModel::fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter=10, double minStepIncrease = 0.01){
+void GaussianMixtureModel::fromHistogram(const Mat histogram, int histSize[2], float c1range[2], float c2range[2], int maxIter=10, double minStepIncrease = 0.01, bool warmStart = false){
     float dim1step = (c1range[1]-c1range[0])/(1.0*histSize[0]);
     float dim2step = (c2range[1]-c2range[0])/(1.0*histSize[1]);
     float dim1start = c1range[0]+dim1step/2.0;
@@ -381,12 +559,53 @@ void GaussianMixtureModel::fromHistogram(const Mat histogram, int histSize[2], f
             }
         }
     }
-    runExpectationMaximization(samples, maxIter, minStepIncrease);
+    runExpectationMaximization(samples, maxIter, minStepIncrease, warmStart);
     makeLookup(histSize,c1range,c2range);
 }
 
+ColorQuantizer::ColorQuantizer() : bits(0){
+    histSize[0] = 0;
+    histSize[1] = 0;
+}
+
+ColorQuantizer::ColorQuantizer(int colorspaceCode, Histogram layout, int bitsPerChannel){
+    bits = std::max(1, std::min(bitsPerChannel, 5));
+    histSize[0] = layout.histSize[0];
+    histSize[1] = layout.histSize[1];
+    int levels = 1<<bits;
+    int shift = 8-bits;
+    int half = (1<<shift)/2;
+    Mat colors(levels*levels*levels, 1, CV_8UC3);
+    for (int q=0; q<colors.rows; q++){
+        int b = q>>(2*bits);
+        int g = (q>>bits)&(levels-1);
+        int r = q&(levels-1);
+        colors.at<Vec3b>(q,0) = Vec3b((b<<shift)+half, (g<<shift)+half, (r<<shift)+half);
+    }
+    Mat converted;
+    cvtColor(colors, converted, colorspaceCode);
+    Mat bins;
+    layout.binIndex(converted, &bins);
+    binLookup = bins.reshape(1,1);
+}
+
+void ColorQuantizer::quantize(const Mat image, Mat& index){
+    CV_Assert(image.type()==CV_8UC3);
+    index.create(image.size(), CV_16UC1);
+    int shift = 8-bits;
+    for (int y=0; y<image.rows; y++){
+        const uchar* src = image.ptr<uchar>(y);
+        ushort* dst = index.ptr<ushort>(y);
+        for (int x=0; x<image.cols; x++){
+            dst[x] = ((src[0]>>shift)<<(2*bits)) | ((src[1]>>shift)<<bits) | (src[2]>>shift);
+            src += 3;
+        }
+    }
+}
+
 ColorHistBackProject::ColorHistBackProject(){
     name = "ColorHistBackProject";
+    prefilter = PREFILTER_BILATERAL;
     int histSize[2];
     int channels[2];
     float c1range[2];
@@ -405,6 +624,7 @@ ColorHistBackProject::ColorHistBackProject(){
 
 ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize){
     name = "ColorHistBackProject";
+    prefilter = PREFILTER_BILATERAL;
     int channels[2];
     float c1range[2];
     float c2range[2];
@@ -434,6 +654,7 @@ ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize){
 
 ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize, String filename){
     name = "ColorHistBackProject";
+    prefilter = PREFILTER_BILATERAL;
     int histSize[2];
     int channels[2];
     float c1range[2];
@@ -462,11 +683,63 @@ ColorHistBackProject::ColorHistBackProject(int code, const int* histogramSize, S
     initialized=true;
 }
 
-void ColorHistBackProject::preprocess(const Mat image, Mat* outputImage){
+void applyPrefilter(const Mat image, Mat& outputImage, Prefilter type){
+    switch (type){
+    case PREFILTER_BOX:
+        blur(image, outputImage, Size(5,5));
+        break;
+    case PREFILTER_GAUSSIAN:
+        GaussianBlur(image, outputImage, Size(5,5), 0);
+        break;
+    case PREFILTER_BILATERAL_DOWNSAMPLED: {
+        //a 5 pixel neighbourhood at half resolution covers the same area as a 9 pixel one at full resolution
+        Mat small;
+        Mat filtered;
+        resize(image, small, Size((image.cols+1)/2, (image.rows+1)/2), 0, 0, INTER_AREA);
+        bilateralFilter(small, filtered, 5, 75, 30);
+        resize(filtered, outputImage, image.size(), 0, 0, INTER_LINEAR);
+        break;
+    }
+    case PREFILTER_GUIDED: {
+        //each channel guides itself: q = mean(a)*I + mean(b) with a = var/(var+eps) and b = (1-a)*mean
+        double eps = 0.01*255*255;
+        Size window(5,5);
+        vector<Mat> planes;
+        split(image, planes);
+        for (int c=0; c<planes.size(); c++){
+            Mat I;
+            planes[c].convertTo(I, CV_32F);
+            Mat meanI;
+            Mat meanII;
+            boxFilter(I, meanI, CV_32F, window);
+            boxFilter(I.mul(I), meanII, CV_32F, window);
+            Mat varI = meanII-meanI.mul(meanI);
+            Mat a;
+            divide(varI, varI+Scalar(eps), a);
+            Mat b = meanI-a.mul(meanI);
+            boxFilter(a, a, CV_32F, window);
+            boxFilter(b, b, CV_32F, window);
+            Mat q = a.mul(I)+b;
+            q.convertTo(planes[c], image.depth());
+        }
+        merge(planes, outputImage);
+        break;
+    }
+    case PREFILTER_BILATERAL:
+        bilateralFilter(image, outputImage, 5, 75, 60);
+        break;
+    case PREFILTER_NONE:
+    default:
+        image.copyTo(outputImage);
+        break;
+    }
+}
+
+void ColorHistBackProject::preprocess8U(const Mat image, Mat* outputImage){
     //GaussianBlur(image, *outputImage, Size(15,15),0);
     //medianBlur(image, *outputImage, 7);
 
-    bilateralFilter(image, *outputImage, 5, 75, 60);
+    applyPrefilter(image, *outputImage, prefilter);
     cvtColor(*outputImage, *outputImage, colorspaceCode);
 
     Mat temp;
@@ -491,12 +764,15 @@ void ColorHistBackProject::preprocess(const Mat image, Mat* outputImage){
 
     //inRange(*outputImage, lowRange, highRange, histogramMask);
 
-    outputImage->convertTo(*outputImage, CV_32F);
-
     //medianBlur(*outputImage, *outputImage, 5);
     //blur(*outputImage, *outputImage, Size(5,5));
 }
 
+void ColorHistBackProject::preprocess(const Mat image, Mat* outputImage){
+    preprocess8U(image, outputImage);
+    outputImage->convertTo(*outputImage, CV_32F);
+}
+
 void ColorHistBackProject::histFromImage(const Mat image){
     Mat cvtImage;
     preprocess(image, &cvtImage);
@@ -517,8 +793,10 @@ void ColorHistBackProject::updateHistogram(const Mat image, const Mat mask){
 
 void ColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
     Mat cvtImage;
-    preprocess(inputImage, &cvtImage);
-    objHistogram.backPropagate(cvtImage, outputImage);
+    preprocess8U(inputImage, &cvtImage);
+    Mat probImage;
+    objHistogram.backPropagate8U(cvtImage, &probImage);
+    probImage.convertTo(*outputImage, CV_32F, 1/255.0);
 }
 
 
@@ -576,29 +854,55 @@ GMMColorHistBackProject::GMMColorHistBackProject(int code, const int* histogramS
 
 void GMMColorHistBackProject::process(const Mat inputImage, Mat* outputImage){
     Mat cvtImage;
-    preprocess(inputImage, &cvtImage);
-
-    objHistogram.backPropagate(cvtImage, outputImage);
+    preprocess8U(inputImage, &cvtImage);
 
     Histogram imgHist = Histogram(objHistogram);
     int size[2] = {16,16};
     imgHist.resize(size);
     imgHist.fromImage(cvtImage);
 
-    medianBlur(*outputImage, *outputImage, 5);
-    Mat aprioriColor;
-    imgHist.backPropagate(cvtImage, &aprioriColor);
-    medianBlur(aprioriColor, aprioriColor, 5);
-    *outputImage = *outputImage/aprioriColor;
-    double histMax = 0;
-    double histMin = 0;
-    minMaxLoc(*outputImage, &histMin, &histMax, NULL, NULL);
-    outputImage->convertTo(*outputImage,CV_32F,1/(histMax-histMin),-histMin/(histMax-histMin));
-
-
+    //the object/prior ratio is taken per bin, each object bin divided by the coarse prior bin containing it, and
+    //normalized over the bins present in the frame, which leaves a single 8-bit backprojection
+    const Mat& obj = objHistogram.normalized;
+    const Mat& prior = imgHist.normalized;
+    Mat ratio(obj.size(), CV_32F);
+    float ratioMin = 0;
+    float ratioMax = 0;
+    bool first = true;
+    for (int i=0; i<obj.rows; i++){
+        const float* priorRow = prior.ptr<float>(i*prior.rows/obj.rows);
+        const float* objRow = obj.ptr<float>(i);
+        float* ratioRow = ratio.ptr<float>(i);
+        for (int j=0; j<obj.cols; j++){
+            float p = priorRow[j*prior.cols/obj.cols];
+            if (p<=0){
+                ratioRow[j] = -1;
+                continue;
+            }
+            ratioRow[j] = objRow[j]/p;
+            if (first || ratioRow[j]<ratioMin){
+                ratioMin = ratioRow[j];
+            }
+            if (first || ratioRow[j]>ratioMax){
+                ratioMax = ratioRow[j];
+            }
+            first = false;
+        }
+    }
+    float scale = ratioMax>ratioMin ? 1/(ratioMax-ratioMin) : 0;
+    for (int i=0; i<ratio.rows; i++){
+        float* ratioRow = ratio.ptr<float>(i);
+        for (int j=0; j<ratio.cols; j++){
+            ratioRow[j] = ratioRow[j]<0 ? 0 : (ratioRow[j]-ratioMin)*scale;
+        }
+    }
 
-    //outputImage->convertTo(*outputImage, CV_32FC1);
-    //outputImage->convertTo(*outputImage, CV_64F);
+    Histogram ratioHist = Histogram(objHistogram);
+    ratio.copyTo(ratioHist.normalized);
+    Mat probImage;
+    ratioHist.backPropagate8U(cvtImage, &probImage);
+    medianBlur(probImage, probImage, 5);
+    probImage.convertTo(*outputImage, CV_32F, 1/255.0);
 }
 
 void GMMColorHistBackProject::histFromImage(const Mat image){
@@ -647,54 +951,475 @@ void SimpleThresholder::process(const Mat inputImage, Mat* outputImage){
 
 
 
+PixelRun::PixelRun(): row(0), start(0), end(0){}
+
+PixelRun::PixelRun(int runRow, int runStart, int runEnd): row(runRow), start(runStart), end(runEnd){}
+
+bool PixelRun::operator<(const PixelRun& other) const{
+    return row<other.row || (row==other.row && start<other.start);
+}
+
+BlobMoments::BlobMoments(): m00(0), m10(0), m01(0), m20(0), m11(0), m02(0){}
+
+void BlobMoments::add(int row, int start, int end){
+    //closed form sums of x and x^2 over [start, end)
+    double n = end-start;
+    double last = end-1;
+    double sumX = n*(start+last)/2.0;
+    double sumXX = (last*(last+1)*(2*last+1)-(start-1.0)*start*(2*start-1.0))/6.0;
+    m00 += n;
+    m10 += sumX;
+    m01 += n*row;
+    m20 += sumXX;
+    m11 += sumX*row;
+    m02 += n*row*(double)row;
+}
+
+void BlobMoments::add(const BlobMoments& other){
+    m00 += other.m00;
+    m10 += other.m10;
+    m01 += other.m01;
+    m20 += other.m20;
+    m11 += other.m11;
+    m02 += other.m02;
+}
+
+Point2f BlobMoments::centroid() const{
+    if (m00<=0){
+        return Point2f(0,0);
+    }
+    return Point2f(m10/m00, m01/m00);
+}
+
+RotatedRect BlobMoments::ellipse() const{
+    if (m00<=0){
+        return RotatedRect();
+    }
+    Point2f center = centroid();
+    float mxx = m20/m00-center.x*(double)center.x;
+    float mxy = m11/m00-center.x*(double)center.y;
+    float myy = m02/m00-center.y*(double)center.y;
+
+    float K = sqrt(std::max(0.0f, (float)pow(mxx+myy,2)-4*(mxx*myy-(float)pow(mxy,2))));
+    RotatedRect temp;
+    temp.center = center;
+    Size stemp;
+    float l1 = (mxx+myy+K)/2;
+    float l2 = std::max(0.0f, (mxx+myy-K)/2);
+    stemp.width = 2*sqrt(l1)*2.0;
+    stemp.height = 2*sqrt(l2)*2.0;
+    temp.size = stemp;
+    temp.angle = atan2(mxx-l1, -mxy)*180.0f/3.141592653589f;
+    return temp;
+}
+
+void BlobMoments::translate(double dx, double dy){
+    m20 += 2*dx*m10+dx*dx*m00;
+    m11 += dx*m01+dy*m10+dx*dy*m00;
+    m02 += 2*dy*m01+dy*dy*m00;
+    m10 += dx*m00;
+    m01 += dy*m00;
+}
+
+Blob::Blob(): pixelCount(0){}
+
+void Blob::add(int row, int start, int end){
+    if (end<=start){
+        return;
+    }
+    pixelCount += end-start;
+    moments.add(row, start, end);
+    if (!runs.empty() && runs.back().row==row && runs.back().end==start){
+        runs.back().end = end;
+    }
+    else {
+        runs.push_back(PixelRun(row, start, end));
+    }
+}
+
+void Blob::translate(int dx, int dy){
+    for (int i=0; i<runs.size(); i++){
+        runs[i].row += dy;
+        runs[i].start += dx;
+        runs[i].end += dx;
+    }
+    moments.translate(dx, dy);
+}
+
+void Blob::merge(const Blob& other){
+    if (other.runs.empty()){
+        return;
+    }
+    if (runs.empty() || runs.back()<other.runs.front()){
+        for (int i=0; i<other.runs.size(); i++){
+            add(other.runs[i].row, other.runs[i].start, other.runs[i].end);
+        }
+        return;
+    }
+    //interleave both run lists in raster order
+    std::vector<PixelRun> merged(runs.size()+other.runs.size());
+    std::merge(runs.begin(), runs.end(), other.runs.begin(), other.runs.end(), merged.begin());
+    *this = Blob();
+    for (int i=0; i<merged.size(); i++){
+        add(merged[i].row, merged[i].start, merged[i].end);
+    }
+}
+
+int Blob::area() const{
+    return pixelCount;
+}
+
+bool Blob::empty() const{
+    return pixelCount==0;
+}
+
+Rect Blob::boundingRect() const{
+    if (runs.empty()){
+        return Rect();
+    }
+    int left = runs[0].start;
+    int right = runs[0].end;
+    for (int i=1; i<runs.size(); i++){
+        left = std::min(left, runs[i].start);
+        right = std::max(right, runs[i].end);
+    }
+    return Rect(left, runs.front().row, right-left, runs.back().row-runs.front().row+1);
+}
+
+std::vector<Point2i> Blob::toPoints() const{
+    std::vector<Point2i> points;
+    points.reserve(pixelCount);
+    for (int i=0; i<runs.size(); i++){
+        for (int x=runs[i].start; x<runs[i].end; x++){
+            points.push_back(Point2i(x, runs[i].row));
+        }
+    }
+    return points;
+}
+
+void Blob::toMask(Mat& mask, uchar value) const{
+    for (int i=0; i<runs.size(); i++){
+        uchar* row = mask.ptr<uchar>(runs[i].row);
+        for (int x=runs[i].start; x<runs[i].end; x++){
+            row[x] = value;
+        }
+    }
+}
+
+int RunLabeler::findRoot(std::vector<int>& parent, int i){
+    while (parent[i]!=i){
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+RunLabeler::RunLabeler(){
+    eightConnected = false;
+    reset();
+}
+
+void RunLabeler::reset(){
+    runRow.clear();
+    runStart.clear();
+    runEnd.clear();
+    parent.clear();
+    strong.clear();
+    currentRow = -2;
+    rowFirst = 0;
+    prevFirst = 0;
+    prevLast = 0;
+    prevCursor = 0;
+}
+
+void RunLabeler::addRun(int row, int start, int end, bool isStrong){
+    int idx = runStart.size();
+    if (row!=currentRow){
+        //runs of the previous row are only candidates if it is directly above
+        prevFirst = row==currentRow+1 ? rowFirst : idx;
+        prevLast = idx;
+        prevCursor = prevFirst;
+        rowFirst = idx;
+        currentRow = row;
+    }
+    runRow.push_back(row);
+    runStart.push_back(start);
+    runEnd.push_back(end);
+    parent.push_back(idx);
+    strong.push_back(isStrong);
+
+    //merge with all runs of the previous row sharing at least one column, or a corner with 8-connectivity
+    int reach = eightConnected ? 1 : 0;
+    while (prevCursor<prevLast && runEnd[prevCursor]+reach<=start){
+        prevCursor++;
+    }
+    for (int q=prevCursor; q<prevLast && runStart[q]<end+reach; q++){
+        int r1 = findRoot(parent, q);
+        int r2 = findRoot(parent, idx);
+        if (r1<r2){
+            parent[r2] = r1;
+        }
+        else if (r2<r1){
+            parent[r1] = r2;
+        }
+    }
+}
+
+/* only components containing a strong run and at least minArea pixels are kept */
+void RunLabeler::label(double minArea, std::vector<Blob>& blobs){
+    int numRuns = runStart.size();
+    std::vector<int> root(numRuns);
+    std::vector<int> area(numRuns, 0);
+    for (int r=0; r<numRuns; r++){
+        root[r] = findRoot(parent, r);
+        area[root[r]] += runEnd[r]-runStart[r];
+        strong[root[r]] |= strong[r];
+    }
+    std::vector<int> blobIdx(numRuns, -1);
+    blobs.clear();
+    for (int r=0; r<numRuns; r++){
+        if (root[r]==r && strong[r] && area[r]>=minArea){
+            blobIdx[r] = blobs.size();
+            blobs.push_back(Blob());
+        }
+    }
+    for (int r=0; r<numRuns; r++){
+        int b = blobIdx[root[r]];
+        if (b>=0){
+            blobs[b].add(runRow[r], runStart[r], runEnd[r]);
+        }
+    }
+}
+
+void RunLabeler::supportBounds(std::vector<Rect>& bounds){
+    int numRuns = runStart.size();
+    std::vector<int> boxIdx(numRuns, -1);
+    for (int r=0; r<numRuns; r++){
+        int root = findRoot(parent, r);
+        Rect run(runStart[r], runRow[r], runEnd[r]-runStart[r], 1);
+        if (boxIdx[root]<0){
+            boxIdx[root] = bounds.size();
+            bounds.push_back(run);
+        }
+        else {
+            bounds[boxIdx[root]] |= run;
+        }
+    }
+}
+
 SimpleBlobDetect::SimpleBlobDetect(){
     name = "SimpleBlobDetect";
     initialized = true;
+    drawBlobs = true;
+}
+
+static bool largerBlob(const Blob& b1, const Blob& b2){
+    return b1.area()>b2.area();
+}
+
+static void joinRuns(std::vector<int>& parent, int a, int b){
+    int r1 = RunLabeler::findRoot(parent, a);
+    int r2 = RunLabeler::findRoot(parent, b);
+    if (r1<r2){
+        parent[r2] = r1;
+    }
+    else if (r2<r1){
+        parent[r1] = r2;
+    }
+}
+
+//paints the part of [start, end) not covered by the runs [first, last) of a neighbouring row
+static void paintUncovered(Vec3b* row, int start, int end, const std::vector<PixelRun>& runs, int first, int last, Vec3b color){
+    int x = start;
+    for (int q=first; q<last && x<end; q++){
+        if (runs[q].end<=x){
+            continue;
+        }
+        for (; x<std::min(end, runs[q].start); x++){
+            row[x] = color;
+        }
+        x = std::max(x, runs[q].end);
+    }
+    for (; x<end; x++){
+        row[x] = color;
+    }
+}
+
+/* the pixels of a blob with a 4-neighbour outside of it, runs are in raster order. Holes are part of the blob, so
+   this is the external outline */
+static void drawOutline(Mat& image, const Blob& blob, Vec3b color){
+    const std::vector<PixelRun>& runs = blob.runs;
+    int prevFirst = 0, prevLast = 0;
+    int rowFirst = 0;
+    while (rowFirst<runs.size()){
+        int y = runs[rowFirst].row;
+        int rowLast = rowFirst;
+        while (rowLast<runs.size() && runs[rowLast].row==y){
+            rowLast++;
+        }
+        bool above = prevLast>prevFirst && runs[prevFirst].row==y-1;
+        int nextLast = rowLast;
+        while (nextLast<runs.size() && runs[nextLast].row==y+1){
+            nextLast++;
+        }
+        Vec3b* row = image.ptr<Vec3b>(y);
+        for (int r=rowFirst; r<rowLast; r++){
+            row[runs[r].start] = color;
+            row[runs[r].end-1] = color;
+            paintUncovered(row, runs[r].start, runs[r].end, runs, above ? prevFirst : 0, above ? prevLast : 0, color);
+            paintUncovered(row, runs[r].start, runs[r].end, runs, rowLast, nextLast, color);
+        }
+        prevFirst = rowFirst;
+        prevLast = rowLast;
+        rowFirst = rowLast;
+    }
 }
 
+/* every row is split into alternating foreground and background runs. Foreground runs are merged with
+   8-connectivity and background runs with 4-connectivity, and background touching the image border is merged into
+   element 0. Once the frame is scanned, background components not reaching element 0 are holes and join the
+   foreground run left of them, which gives the same regions as external contours without labeling any image */
 void SimpleBlobDetect::process(const Mat inputImage, Mat* outputImage){
-    vector<vector<Point> > contours;
-    vector<Vec4i> hierarchy;
-    Mat conv(inputImage.size(), CV_8U);
-    inputImage.convertTo(conv, CV_8U);
-    findContours(conv, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, Point(0, 0) );
-    Mat temp = Mat::zeros(inputImage.size(), CV_8UC3);
-    double area = contourArea(contours[0], false);
-    double maxarea = area;
-    double minarea = area;
-    for( int i = 1; i< contours.size(); i++ ){
-        area = contourArea(contours[i], false);
-        if (area > maxarea){maxarea = area;}
-        if (area < minarea){minarea = area;}
+    Mat conv = inputImage;
+    if (inputImage.type()!=CV_8UC1){
+        inputImage.convertTo(conv, CV_8U);
     }
-    
-    
-    for( int i = 0; i< contours.size(); i++ ){
-        Scalar color = Scalar(0, 0, 255);
-        switch (i%6){
-        case 0: color = Scalar(0,0,255); break;
-        case 1: color = Scalar(0,255,255); break;
-        case 2: color = Scalar(0,255,0); break;
-        case 3: color = Scalar(255,255,0); break;
-        case 4: color = Scalar(255,0,0); break;
-        case 5: color = Scalar(255,0,255); break;
+    runRow.clear();
+    runStart.clear();
+    runEnd.clear();
+    foreground.clear();
+    parent.assign(1, 0);
+    runRow.push_back(-1);
+    runStart.push_back(0);
+    runEnd.push_back(0);
+    foreground.push_back(false);
+
+    int prevFirst = 1, prevLast = 1;
+    for (int y=0; y<conv.rows; y++){
+        const uchar* row = conv.ptr<uchar>(y);
+        int rowFirst = runStart.size();
+        int prevCursor = prevFirst;
+        int x = 0;
+        while (x<conv.cols){
+            bool fg = row[x]!=0;
+            int start = x;
+            while (x<conv.cols && (row[x]!=0)==fg){
+                x++;
+            }
+            int idx = runStart.size();
+            runRow.push_back(y);
+            runStart.push_back(start);
+            runEnd.push_back(x);
+            foreground.push_back(fg);
+            parent.push_back(idx);
+            if (!fg && (y==0 || y==conv.rows-1 || start==0 || x==conv.cols)){
+                joinRuns(parent, 0, idx);
+            }
+            //runs of the previous row alternate as well, only those of the same kind are merged
+            int reach = fg ? 1 : 0;
+            while (prevCursor<prevLast && runEnd[prevCursor]+1<=start){
+                prevCursor++;
+            }
+            for (int q=prevCursor; q<prevLast && runStart[q]<x+1; q++){
+                if (foreground[q]==fg && runEnd[q]+reach>start && runStart[q]<x+reach){
+                    joinRuns(parent, q, idx);
+                }
+            }
+        }
+        prevFirst = rowFirst;
+        prevLast = runStart.size();
+    }
+
+    int numRuns = runStart.size();
+    for (int r=2; r<numRuns; r++){
+        if (runRow[r]!=runRow[r-1]){
+            continue;
+        }
+        int hole = foreground[r] ? r-1 : r;
+        if (RunLabeler::findRoot(parent, hole)!=0){
+            joinRuns(parent, r-1, r);
+        }
+    }
+    std::vector<int> blobIdx(numRuns, -1);
+    blobs.clear();
+    for (int r=1; r<numRuns; r++){
+        int root = RunLabeler::findRoot(parent, r);
+        if (root==0){
+            continue;
         }
-        area = contourArea(contours[i], false);
-        if ((area-minarea)/(maxarea-minarea)>0.5){
-            drawContours(temp, contours, i, color, 2, 8);
+        if (blobIdx[root]<0){
+            blobIdx[root] = blobs.size();
+            blobs.push_back(Blob());
         }
+        blobs[blobIdx[root]].add(runRow[r], runStart[r], runEnd[r]);
     }
-    temp.copyTo(*outputImage);
+
+    std::sort(blobs.begin(), blobs.end(), largerBlob);
+    if (!blobs.empty()){
+        double maxarea = blobs.front().area();
+        double minarea = blobs.back().area();
+        //blobs of equal size are all kept
+        int kept = 1;
+        while (kept<blobs.size() && (maxarea==minarea || (blobs[kept].area()-minarea)/(maxarea-minarea)>0.5)){
+            kept++;
+        }
+        blobs.resize(kept);
+    }
+
+    if (!drawBlobs){
+        Mat mask = Mat::zeros(conv.size(), CV_8U);
+        for (int i=0; i<blobs.size(); i++){
+            blobs[i].toMask(mask, 255);
+        }
+        *outputImage = mask;
+        return;
+    }
+    Mat temp = Mat::zeros(conv.size(), CV_8UC3);
+    for (int i=0; i<blobs.size(); i++){
+        Vec3b color;
+        switch (i%6){
+        case 0: color = Vec3b(0,0,255); break;
+        case 1: color = Vec3b(0,255,255); break;
+        case 2: color = Vec3b(0,255,0); break;
+        case 3: color = Vec3b(255,255,0); break;
+        case 4: color = Vec3b(255,0,0); break;
+        case 5: color = Vec3b(255,0,255); break;
+        }
+        drawOutline(temp, blobs[i], color);
+    }
+    *outputImage = temp;
 }
 
 OpticalFlow::OpticalFlow(){
     name = "OpticalFlow";
     init = false;
+    sparse = false;
+    maxFeatures = 30;
+    pyramidLevels = 2;
+    windowSize = Size(15,15);
+}
+
+void OpticalFlow::setRegions(const std::vector<Rect>& newRegions){
+    std::vector<std::vector<Point2f> > kept(newRegions.size());
+    for (int r=0; r<newRegions.size() && r<regionPoints.size(); r++){
+        for (int i=0; i<regionPoints[r].size(); i++){
+            if (newRegions[r].contains(regionPoints[r][i])){
+                kept[r].push_back(regionPoints[r][i]);
+            }
+        }
+    }
+    regions = newRegions;
+    regionPoints.swap(kept);
 }
 
 void OpticalFlow::process(const Mat inputImage, Mat *outputImage){
     Mat imbw;
     cvtColor(inputImage, imbw, CV_BGR2GRAY);
+    if (sparse){
+        processSparse(imbw, outputImage);
+        return;
+    }
+    oldPyramid.clear();
     blur(imbw, imbw, Size(7,7));
     if (!init){
         init=true;
@@ -711,6 +1436,85 @@ void OpticalFlow::process(const Mat inputImage, Mat *outputImage){
     imbw.copyTo(old);
 }
 
+/* features are detected in the previous frame of regions that lost more than half of them, then all regions are
+   tracked with a single Lucas-Kanade call. The median displacement is robust to the features that land on the
+   background. */
+void OpticalFlow::processSparse(const Mat gray, Mat* outputImage){
+    std::vector<Rect> active = regions;
+    if (active.empty()){
+        active.push_back(Rect(0, 0, gray.cols, gray.rows));
+    }
+    regionPoints.resize(active.size());
+    regionMotion.assign(active.size(), Point2f(0,0));
+    regionSupport.assign(active.size(), 0);
+    buildOpticalFlowPyramid(gray, pyramid, windowSize, pyramidLevels);
+
+    bool usable = init && !oldPyramid.empty() && old.size()==gray.size();
+    *outputImage = Mat::zeros(gray.size(), CV_32F);
+    if (usable){
+        std::vector<Point2f> prevPts;
+        std::vector<int> owner;
+        Rect frame(0, 0, gray.cols, gray.rows);
+        for (int r=0; r<active.size(); r++){
+            Rect region = active[r] & frame;
+            if (region.area()==0){
+                regionPoints[r].clear();
+                continue;
+            }
+            if (regionPoints[r].size()*2<maxFeatures){
+                goodFeaturesToTrack(old(region), regionPoints[r], maxFeatures, 0.01, 3);
+                for (int i=0; i<regionPoints[r].size(); i++){
+                    regionPoints[r][i].x += region.x;
+                    regionPoints[r][i].y += region.y;
+                }
+            }
+            for (int i=0; i<regionPoints[r].size(); i++){
+                prevPts.push_back(regionPoints[r][i]);
+                owner.push_back(r);
+            }
+        }
+
+        std::vector<Point2f> nextPts;
+        std::vector<uchar> status;
+        std::vector<float> err;
+        if (!prevPts.empty()){
+            calcOpticalFlowPyrLK(oldPyramid, pyramid, prevPts, nextPts, status, err, windowSize, pyramidLevels,
+                                 TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 20, 0.03));
+        }
+        std::vector<std::vector<float> > dx(active.size());
+        std::vector<std::vector<float> > dy(active.size());
+        for (int r=0; r<active.size(); r++){
+            regionPoints[r].clear();
+        }
+        for (int i=0; i<nextPts.size(); i++){
+            if (!status[i]){
+                continue;
+            }
+            int r = owner[i];
+            dx[r].push_back(nextPts[i].x-prevPts[i].x);
+            dy[r].push_back(nextPts[i].y-prevPts[i].y);
+            if (active[r].contains(nextPts[i])){
+                regionPoints[r].push_back(nextPts[i]);
+            }
+        }
+        for (int r=0; r<active.size(); r++){
+            int n = dx[r].size();
+            if (n==0){
+                continue;
+            }
+            std::nth_element(dx[r].begin(), dx[r].begin()+n/2, dx[r].end());
+            std::nth_element(dy[r].begin(), dy[r].begin()+n/2, dy[r].end());
+            regionMotion[r] = Point2f(dx[r][n/2], dy[r][n/2]);
+            regionSupport[r] = n;
+            Mat regionOut = (*outputImage)(active[r] & frame);
+            regionOut.setTo(Scalar(fabs(regionMotion[r].x)+fabs(regionMotion[r].y)));
+        }
+    }
+    init = true;
+    gray.copyTo(old);
+    oldPyramid.swap(pyramid);
+}
+
 BGSubtractor::BGSubtractor(){
     name = "BGSubtractor";
     bgsub = BackgroundSubtractorMOG(4,3,0.4);
@@ -726,4 +1530,91 @@ void BGSubtractor::process(const Mat inputImage, Mat *outputImage){
     bgsub(imbw, *outputImage, 0.01);
 }
 
+RunningAvgBGSubtractor::RunningAvgBGSubtractor(){
+    name = "RunningAvgBGSubtractor";
+    initialized = true;
+    halfResolution = true;
+    learningShift = 5;
+    deviationFactor = 3;
+    minThreshold = 10;
+    vectorized = true;
+}
+
+void RunningAvgBGSubtractor::reset(){
+    background.release();
+    deviation.release();
+}
+
+/* all quantities are gray levels scaled by 128, so differences fit in a signed 16-bit integer */
+void RunningAvgBGSubtractor::updateRow(const uchar* gray, short* bg, short* dev, uchar* fg, int width){
+    int shift = learningShift;
+    int slowShift = learningShift+2;
+    short minDiff = std::min(255, minThreshold)<<7;
+    int x = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i minDiffV = _mm_set1_epi16(minDiff);
+    __m128i shiftV = _mm_cvtsi32_si128(shift);
+    __m128i slowShiftV = _mm_cvtsi32_si128(slowShift);
+    for (; vectorized && x+8<=width; x+=8){
+        __m128i g = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(gray+x)), zero), 7);
+        __m128i b = _mm_loadu_si128((const __m128i*)(bg+x));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dev+x));
+        __m128i diff = _mm_sub_epi16(g, b);
+        __m128i absDiff = _mm_max_epi16(diff, _mm_sub_epi16(zero, diff));
+        __m128i thresh = minDiffV;
+        for (int k=0; k<deviationFactor; k++){
+            thresh = _mm_adds_epi16(thresh, d);
+        }
+        __m128i isFg = _mm_cmpgt_epi16(absDiff, thresh);
+        //foreground lanes take the slow update
+        __m128i bgStep = _mm_or_si128(_mm_and_si128(isFg, _mm_sra_epi16(diff, slowShiftV)),
+                                      _mm_andnot_si128(isFg, _mm_sra_epi16(diff, shiftV)));
+        __m128i devDiff = _mm_sub_epi16(absDiff, d);
+        __m128i devStep = _mm_or_si128(_mm_and_si128(isFg, _mm_sra_epi16(devDiff, slowShiftV)),
+                                       _mm_andnot_si128(isFg, _mm_sra_epi16(devDiff, shiftV)));
+        _mm_storeu_si128((__m128i*)(bg+x), _mm_add_epi16(b, bgStep));
+        _mm_storeu_si128((__m128i*)(dev+x), _mm_add_epi16(d, devStep));
+        _mm_storel_epi64((__m128i*)(fg+x), _mm_packs_epi16(isFg, zero));
+    }
+#endif
+    for (; x<width; x++){
+        int diff = (gray[x]<<7)-bg[x];
+        int absDiff = std::abs(diff);
+        int thresh = std::min(32767, minDiff+deviationFactor*dev[x]);
+        bool isFg = absDiff>thresh;
+        int s = isFg ? slowShift : shift;
+        bg[x] += diff>>s;
+        dev[x] += (absDiff-dev[x])>>s;
+        fg[x] = isFg ? 255 : 0;
+    }
+}
 
+void RunningAvgBGSubtractor::process(const Mat inputImage, Mat* outputImage){
+    Mat gray;
+    if (inputImage.channels()==3){
+        cvtColor(inputImage, gray, CV_BGR2GRAY);
+    }
+    else {
+        inputImage.convertTo(gray, CV_8U);
+    }
+    if (halfResolution){
+        resize(gray, gray, Size((gray.cols+1)/2, (gray.rows+1)/2), 0, 0, INTER_AREA);
+    }
+    if (background.size()!=gray.size()){
+        //the first frame is taken as the background, with the minimum threshold as the only tolerance
+        gray.convertTo(background, CV_16S, 128);
+        deviation = Mat::zeros(gray.size(), CV_16S);
+    }
+    Mat mask(gray.size(), CV_8U);
+    for (int y=0; y<gray.rows; y++){
+        updateRow(gray.ptr<uchar>(y), background.ptr<short>(y), deviation.ptr<short>(y), mask.ptr<uchar>(y), gray.cols);
+    }
+    if (halfResolution){
+        resize(mask, foreground, inputImage.size(), 0, 0, INTER_NEAREST);
+    }
+    else {
+        foreground = mask;
+    }
+    foreground.copyTo(*outputImage);
+}
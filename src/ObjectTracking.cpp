@@ -11,6 +11,7 @@
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <cfloat>
 
 #ifdef TESTMODE
 #define VISUALDEBUG true
@@ -23,50 +24,187 @@ using namespace std;
 
 namespace fs = boost::filesystem;
 
-UpdatableHistogram::UpdatableHistogram(): Histogram(), buffersize(0){}
+GMMRefit::GMMRefit(int histogramSize[], float channel1range[], float channel2range[]): stopping(false), running(false), resultReady(false), iterations(2){
+    histSize[0] = histogramSize[0];
+    histSize[1] = histogramSize[1];
+    c1range[0] = channel1range[0];
+    c1range[1] = channel1range[1];
+    c2range[0] = channel2range[0];
+    c2range[1] = channel2range[1];
+    worker = boost::thread(boost::bind(&GMMRefit::run, this));
+}
+
+GMMRefit::~GMMRefit(){
+    {
+        boost::mutex::scoped_lock scopedLock(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void GMMRefit::start(Mat histogram){
+    running = true;
+    pending = histogram;
+    wake.notify_one();
+}
+
+void GMMRefit::run(){
+    boost::mutex::scoped_lock scopedLock(lock);
+    while (true){
+        while (!stopping && pending.empty()){
+            wake.wait(scopedLock);
+        }
+        if (stopping){
+            return;
+        }
+        Mat histogram = pending;
+        pending = Mat();
+        GaussianMixtureModel model = gmm;
+        int steps = iterations;
+        scopedLock.unlock();
+        //a model that was never fitted (e.g. loaded from a stored histogram) gets a full cold fit once
+        if (model.initialized){
+            model.fromHistogram(histogram, histSize, c1range, c2range, steps, 0.0, true);
+        }
+        else {
+            model = GaussianMixtureModel(2,3);
+            model.fromHistogram(histogram, histSize, c1range, c2range, 20, 0.001, false);
+        }
+        scopedLock.lock();
+        gmm = model;
+        model.lookup.convertTo(result, CV_32F);
+        resultReady = true;
+        running = false;
+    }
+}
+
+UpdatableHistogram::UpdatableHistogram(): Histogram(), buffersize(0), bufferHead(0), bufferValidCount(0), onlineGMMIterations(0){}
 
 UpdatableHistogram::UpdatableHistogram(int channels[], int histogramSize[], float channel1range[], float channel2range[], int bufferSize):
     Histogram(channels, histogramSize, channel1range, channel2range),
-    buffersize(bufferSize)
+    buffersize(bufferSize),
+    bufferHead(0),
+    bufferValidCount(0),
+    onlineGMMIterations(0)
 {}
 
+void UpdatableHistogram::setOnlineGMM(int iterations){
+    onlineGMMIterations = iterations;
+    if (iterations<=0){
+        onlineGMM.release();
+    }
+}
+
+void UpdatableHistogram::refitOnline(const Mat aposteriori){
+    if (!refit){
+        refit = boost::shared_ptr<GMMRefit>(new GMMRefit(histSize, c1range, c2range));
+        if (gmmReady){
+            refit->gmm = gmm;
+        }
+    }
+    boost::mutex::scoped_lock scopedLock(refit->lock);
+    if (refit->resultReady){
+        refit->result.copyTo(onlineGMM);
+        refit->resultReady = false;
+    }
+    if (!refit->running){
+        refit->iterations = onlineGMMIterations;
+        Mat histogram;
+        aposteriori.convertTo(histogram, CV_64F);
+        refit->start(histogram);
+    }
+}
+
+bool UpdatableHistogram::updateColorLookup(const ColorQuantizer& quantizer, double tolerance){
+    //the table is only recompiled when some bin moved by more than the tolerance since the last compilation
+    if (!colorLookup.empty() && colorLookup.cols==quantizer.binLookup.cols && norm(normalized, colorLookupSource, NORM_INF)<=tolerance){
+        return false;
+    }
+    Mat table;
+    normalized.convertTo(table, CV_8U, 255.0);
+    const uchar* tab = table.ptr<uchar>(0);
+    const int* bins = quantizer.binLookup.ptr<int>(0);
+    colorLookup.create(1, quantizer.binLookup.cols, CV_8U);
+    uchar* lut = colorLookup.ptr<uchar>(0);
+    for (int q=0; q<colorLookup.cols; q++){
+        lut[q] = bins[q]>=0 ? tab[bins[q]] : 0;
+    }
+    normalized.copyTo(colorLookupSource);
+    return true;
+}
+
+const Mat& UpdatableHistogram::getColorLookup() const{
+    return colorLookup;
+}
+
 void UpdatableHistogram::update(Mat image, double alpha, const Mat mask){
     const float* ranges[] = {c1range, c2range};
     Mat colorHist;
     calcHist(&image, 1, channels, mask, colorHist, 2, histSize, ranges, true, false);
+    Mat apriori;
+    calcHist(&image, 1, channels, Mat(), apriori, 2, histSize, ranges, true, false);
+    update(colorHist, apriori, alpha);
+}
 
+void UpdatableHistogram::update(const Mat objectHist, const Mat apriori, double alpha){
     double minVal = 0;
     double maxVal = 0;
-    minMaxLoc(colorHist, &minVal, &maxVal);
+    minMaxLoc(objectHist, &minVal, &maxVal);
 
     if (minVal==maxVal){
         return;
     }
 
-    Mat apriori;
-    calcHist(&image, 1, channels, Mat(), apriori, 2, histSize, ranges, true, false);
-
-    apriori.convertTo(apriori, CV_32F);
-    colorHist.convertTo(colorHist, CV_32F);
-
-    Mat aposteriori = colorHist/apriori;
-
-
-    if(buffer.size()>=buffersize){
-        buffer.erase(buffer.begin());
+    Mat colorHist;
+    Mat aprioriHist;
+    objectHist.convertTo(colorHist, CV_32F);
+    apriori.convertTo(aprioriHist, CV_32F);
+
+    Mat aposteriori = colorHist/aprioriHist;
+
+    //ring buffer of the recent aposteriori histograms with a running sum over the non-empty ones
+    int capacity = std::max(1, buffersize);
+    if (buffer.size()!=capacity){
+        buffer.assign(capacity, Mat());
+        bufferValid.assign(capacity, false);
+        bufferSum = Mat::zeros(aposteriori.size(), CV_32F);
+        bufferHead = 0;
+        bufferValidCount = 0;
     }
-    buffer.push_back(aposteriori);
-
-    int full = 1;
-    for (int i=0; i<buffer.size()-1; i++){
-        minMaxLoc(buffer[i], &minVal, &maxVal);
-        if (maxVal>1e-6){
-            aposteriori+=buffer[i];
-            full++;
+    if (bufferValid[bufferHead]){
+        bufferSum -= buffer[bufferHead];
+        bufferValidCount--;
+    }
+    aposteriori.copyTo(buffer[bufferHead]);
+    minMaxLoc(aposteriori, &minVal, &maxVal);
+    bool latestValid = maxVal>1e-6;
+    bufferValid[bufferHead] = latestValid;
+    if (latestValid){
+        bufferSum += aposteriori;
+        bufferValidCount++;
+    }
+    bufferHead = (bufferHead+1)%capacity;
+    if (bufferHead==0){
+        //resum once per lap so rounding errors of the subtractions do not accumulate
+        bufferSum.setTo(Scalar(0));
+        for (int i=0; i<capacity; i++){
+            if (bufferValid[i]){
+                bufferSum += buffer[i];
+            }
         }
     }
-    if (full>1){
-        aposteriori/=full;
+
+    //the latest histogram is always part of the average, even when it is empty
+    int full = bufferValidCount + (latestValid ? 0 : 1);
+    bufferSum.convertTo(aposteriori, CV_32F, 1.0/full);
+
+    //the online model is replaced by the latest GMM refit finished in the background, if any
+    if (onlineGMMIterations>0){
+        refitOnline(aposteriori);
+        if (!onlineGMM.empty()){
+            aposteriori = onlineGMM;
+        }
     }
 
     aposteriori = alpha*offline + (1-alpha)*aposteriori;
@@ -122,80 +260,58 @@ bool UpdatableHistogram::fromStored(std::string rootPath){
     return false;
 }
 
+ObjectSpan::ObjectSpan(int spanObject, int spanStart, int spanEnd): object(spanObject), start(spanStart), end(spanEnd){}
+
 TrackedObject::TrackedObject(){
     tracked = false;
 }
 
-TrackedObject::TrackedObject(const Mat image, const vector<Point> inContour, bool isContour = false): traj({0.3, 0.0},{1.0, -0.7}){
-    if (inContour.size()<5) {tracked = false; return;}
+TrackedObject::TrackedObject(const Mat image, const Blob& inBlob): traj({0.3, 0.0},{1.0, -0.7}){
+    if (inBlob.area()<5) {tracked = false; return;}
     tracked = true;
     imageSize = image.size();
-
-    if (isContour){
-        contour = inContour;
-        points.clear();
-    }
-    else {
-        contour.clear();
-        points = inContour;
-        if (VISUALDEBUG){
-            Mat temp(Mat::zeros(image.size(), CV_8U));
-            for (int i=0; i<points.size(); i++){
-                temp.at<uchar>(points[i])=255;
-            }
-            vector<vector<Point> > contours;
-            findContours(temp, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
-            contour = contours[0];
-        }
+    moments = inBlob.moments;
+    //the runs are only needed to draw the contour, geometry comes from the moments
+    if (VISUALDEBUG){
+        blob = inBlob;
+        updateContour();
     }
-    ellipse = getEllipse();//minAreaRect(inContour);
-    actualEllipse = ellipse;
+    actualEllipse = getEllipse();
+    initMotion(actualEllipse);
     updateArea();
     timeLost = boost::get_system_time();
     occluded = false;
-    estMove = Point2f(0,0);
     kind = -1;
     id = -1;
 }
 
 
-void TrackedObject::update(const Mat image, const vector<Point> inContour, bool isContour = false){
-    if (inContour.size()<5) {tracked = false; return;}
+void TrackedObject::update(const Mat image, const Blob& inBlob){
+    if (inBlob.area()<5) {tracked = false; return;}
     tracked = true;
     imageSize = image.size();
-    if (isContour){
-        points.clear();
-        contour = inContour;
+    moments = inBlob.moments;
+    //the runs are only needed to draw the contour, geometry comes from the moments
+    if (VISUALDEBUG){
+        blob = inBlob;
+        updateContour();
     }
-    else {
-        contour.clear();
-        points = inContour;
-        if (VISUALDEBUG){
-            Mat temp(Mat::zeros(image.size(), CV_8U));
-            for (int i=0; i<points.size(); i++){
-                temp.at<uchar>(points[i])=255;
-            }
-            vector<vector<Point> > contours;
-            findContours(temp, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE
-                         );
-            int maxsize = contours[0].size();
-            int best = 0;
-            for (int i=1; i<contours.size(); i++){
-                if (contours[i].size()>maxsize){
-                    maxsize = contours[i].size();
-                    best = i;
-                }
-            }
-            contour = contours[best];
+    correctMotion(getEllipse());
+}
+
+void TrackedObject::updateContour(){
+    Mat temp(Mat::zeros(imageSize, CV_8U));
+    blob.toMask(temp, 255);
+    vector<vector<Point> > contours;
+    findContours(temp, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
+    contour.clear();
+    int maxsize = 0;
+    for (int i=0; i<contours.size(); i++){
+        if (contours[i].size()>maxsize){
+            maxsize = contours[i].size();
+            contour = contours[i];
         }
     }
-    RotatedRect newEllipse = getEllipse(); //minAreaRect(inContour);
-    estMove = newEllipse.center-actualEllipse.center;
-    actualEllipse = newEllipse;
-    estMove.x /= 2.0;
-    estMove.y /= 2.0;
-    newEllipse.center += estMove;
-    ellipse = newEllipse;
 }
 
 void TrackedObject::updateTrajectory(Point2f pt, long long time){
@@ -203,8 +319,8 @@ void TrackedObject::updateTrajectory(Point2f pt, long long time){
 }
 
 void TrackedObject::updateArea(){
-    if (points.size()>0){
-        area = points.size();
+    if (moments.m00>0){
+        area = moments.m00;
     }
     else{
         area = ellipse.size.area();
@@ -214,33 +330,158 @@ void TrackedObject::updateArea(){
 vector<Point> TrackedObject::pointsFromContour(){
     Mat temp = Mat::zeros(imageSize, CV_8U);
     vector<vector<Point>> conts;
-    points.clear();
     conts.push_back(contour);
     drawContours(temp, conts, 0, Scalar(255), CV_FILLED);
+    blob = Blob();
     for (int i=0; i<temp.rows; i++){
-        for (int j=0; j<temp.cols; j++){
-            if (temp.at<int>(i,j)){
-                points.push_back(Point(i,j));
+        const uchar* row = temp.ptr<uchar>(i);
+        int j = 0;
+        while (j<temp.cols){
+            if (!row[j]){
+                j++;
+                continue;
             }
+            int start = j;
+            while (j<temp.cols && row[j]){
+                j++;
+            }
+            blob.add(i, start, j);
         }
     }
-    return points;
+    moments = blob.moments;
+    return blob.toPoints();
 }
 
-RotatedRect TrackedObject::useCamShift(const Mat probImage){
+RotatedRect TrackedObject::useCamShift(const Mat probImage, Point2i offset){
     //double size = min(ellipse.size.height, ellipse.size.width);
     //Point tl(ellipse.center.x-size/2, ellipse.center.y-size/2);
     //Rect box(tl, Size(size,size));
     Rect box = ellipse.boundingRect();
-    return CamShift(probImage, box, TermCriteria( TermCriteria::EPS | TermCriteria::COUNT, 10, 1 ));
+    box.x -= offset.x;
+    box.y -= offset.y;
+    box &= Rect(0, 0, probImage.cols, probImage.rows);
+    if (box.area()==0){
+        return RotatedRect();
+    }
+    RotatedRect result = CamShift(probImage, box, TermCriteria( TermCriteria::EPS | TermCriteria::COUNT, 10, 1 ));
+    result.center.x += offset.x;
+    result.center.y += offset.y;
+    return result;
+}
+
+void TrackedObject::update(const RotatedRect& newEllipse){
+    tracked = true;
+    //no pixels were labeled, the geometry falls back to the ellipse
+    moments = BlobMoments();
+    blob = Blob();
+    if (VISUALDEBUG){
+        ellipse2Poly(Point(cvRound(newEllipse.center.x), cvRound(newEllipse.center.y)), Size(newEllipse.size.width/2, newEllipse.size.height/2), cvRound(newEllipse.angle), 0, 360, 10, contour);
+    }
+    correctMotion(newEllipse);
+}
+
+/* constant velocity model over [cx, cy, width, height, angle] and their velocities, one step per frame */
+void TrackedObject::initMotion(const RotatedRect& measured){
+    motion.init(10, 5, 0, CV_32F);
+    setIdentity(motion.transitionMatrix);
+    motion.measurementMatrix = Mat::zeros(5, 10, CV_32F);
+    motion.processNoiseCov = Mat::zeros(10, 10, CV_32F);
+    motion.measurementNoiseCov = Mat::zeros(5, 5, CV_32F);
+    motion.errorCovPost = Mat::zeros(10, 10, CV_32F);
+    motion.statePost = Mat::zeros(10, 1, CV_32F);
+    //variances in pixels (center and size) and degrees (angle)
+    float processNoise[5] = {1, 1, 1, 1, 4};
+    float measurementNoise[5] = {4, 4, 16, 16, 25};
+    float initialVelocity = 100;
+    float measurement[5] = {measured.center.x, measured.center.y, measured.size.width, measured.size.height, measured.angle};
+    for (int i=0; i<5; i++){
+        motion.transitionMatrix.at<float>(i, i+5) = 1;
+        motion.measurementMatrix.at<float>(i, i) = 1;
+        motion.processNoiseCov.at<float>(i, i) = processNoise[i]/4;
+        motion.processNoiseCov.at<float>(i+5, i+5) = processNoise[i];
+        motion.measurementNoiseCov.at<float>(i, i) = measurementNoise[i];
+        motion.errorCovPost.at<float>(i, i) = measurementNoise[i];
+        motion.errorCovPost.at<float>(i+5, i+5) = initialVelocity;
+        motion.statePost.at<float>(i) = measurement[i];
+    }
+    predictMotion();
+}
+
+void TrackedObject::correctMotion(const RotatedRect& measured){
+    actualEllipse = measured;
+    motion.predict();
+    //ellipses are symmetric under 180 degree rotations and swapping the axes, measure the angle closest to the prediction
+    RotatedRect normalized = measured;
+    if (normalized.size.height>normalized.size.width){
+        std::swap(normalized.size.width, normalized.size.height);
+        normalized.angle += 90;
+    }
+    float predictedAngle = motion.statePre.at<float>(4);
+    normalized.angle += 180*cvRound((predictedAngle-normalized.angle)/180);
+    Mat measurement = (Mat_<float>(5,1) << normalized.center.x, normalized.center.y, normalized.size.width, normalized.size.height, normalized.angle);
+    motion.correct(measurement);
+    predictMotion();
+}
+
+void TrackedObject::coastMotion(){
+    if (motion.statePost.empty()){
+        return;
+    }
+    //without a measurement predict() carries the prior over to the posterior
+    motion.predict();
+    predictMotion();
+}
+
+void TrackedObject::predictMotion(){
+    Mat predicted = motion.transitionMatrix*motion.statePost;
+    gemm(motion.transitionMatrix, motion.errorCovPost, 1, Mat(), 0, predictedCovariance);
+    gemm(predictedCovariance, motion.transitionMatrix, 1, motion.processNoiseCov, 1, predictedCovariance, GEMM_2_T);
+    ellipse.center = Point2f(predicted.at<float>(0), predicted.at<float>(1));
+    ellipse.size = Size2f(std::max(0.0f, predicted.at<float>(2)), std::max(0.0f, predicted.at<float>(3)));
+    ellipse.angle = predicted.at<float>(4);
+}
+
+double TrackedObject::gateDistance(const BlobMoments& measured){
+    if (predictedCovariance.empty() || measured.m00<=0){
+        return 0;
+    }
+    //innovation covariance of the centroid, widened by the spread of the blob itself
+    Point2f centroid = measured.centroid();
+    double dx = centroid.x-ellipse.center.x;
+    double dy = centroid.y-ellipse.center.y;
+    double sxx = predictedCovariance.at<float>(0,0)+motion.measurementNoiseCov.at<float>(0,0)+measured.m20/measured.m00-centroid.x*(double)centroid.x;
+    double sxy = predictedCovariance.at<float>(0,1)+measured.m11/measured.m00-centroid.x*(double)centroid.y;
+    double syy = predictedCovariance.at<float>(1,1)+motion.measurementNoiseCov.at<float>(1,1)+measured.m02/measured.m00-centroid.y*(double)centroid.y;
+    double det = sxx*syy-sxy*sxy;
+    if (det<=0){
+        return 0;
+    }
+    return (syy*dx*dx-2*sxy*dx*dy+sxx*dy*dy)/det;
+}
+
+Rect TrackedObject::searchWindow(double padding, double sigmas){
+    Rect box = ellipse.boundingRect();
+    double sx = 0;
+    double sy = 0;
+    if (!predictedCovariance.empty()){
+        //position uncertainty plus half of the size uncertainty on each side
+        double sizeSigma = sqrt(std::max(predictedCovariance.at<float>(2,2), predictedCovariance.at<float>(3,3)));
+        sx = sqrt(predictedCovariance.at<float>(0,0))+0.5*sizeSigma;
+        sy = sqrt(predictedCovariance.at<float>(1,1))+0.5*sizeSigma;
+    }
+    int padX = cvCeil(box.width*padding+sigmas*sx);
+    int padY = cvCeil(box.height*padding+sigmas*sy);
+    return Rect(box.x-padX, box.y-padY, box.width+2*padX, box.height+2*padY);
 }
 
 double TrackedObject::compare(boost::shared_ptr<TrackedObject> otherObject){
-    if (intersectingOBB(ellipse, otherObject->ellipse)){
+    OrientedBox box(ellipse);
+    OrientedBox otherBox(otherObject->ellipse);
+    if (box.intersects(otherBox)){
         return 0;
     }
     else {
-        return distRotatedRect(ellipse, otherObject->ellipse);
+        return box.distance(otherBox);
     }
 }
 
@@ -248,61 +489,26 @@ double TrackedObject::getAreaRatio(double compareArea=-1){
     if (compareArea<=0){
         compareArea = area;
     }
-    if(points.size()>0){
-        return points.size()/compareArea;
+    if(moments.m00>0){
+        return moments.m00/compareArea;
     }
     else {
-        return actualEllipse.size.area()/compareArea;
+        return CV_PI/4*actualEllipse.size.area()/compareArea;
     }
 }
 
 
 double TrackedObject::getArea(){
-    if(points.size()>0){
-        return points.size();
+    if(moments.m00>0){
+        return moments.m00;
     }
     else {
-        return actualEllipse.size.area();
+        return CV_PI/4*actualEllipse.size.area();
     }
 }
 
 RotatedRect TrackedObject::getEllipse(){
-    if (points.size()==0){
-        return RotatedRect();
-    }
-    Point2f centroid(0,0);
-    for (int i=0; i<points.size(); i++){
-        centroid.x+=points[i].x;
-        centroid.y+=points[i].y;
-    }
-    centroid.x/=points.size();
-    centroid.y/=points.size();
-    float mxx=0;
-    float mxy=0;
-    float myy=0;
-    for (int i=0; i<points.size(); i++){
-        Point2f pt = points[i];
-        float dx = pt.x-centroid.x;
-        float dy = pt.y-centroid.y;
-        mxx+=dx*dx;
-        mxy+=dx*dy;
-        myy+=dy*dy;
-    }
-    mxx/=points.size();
-    myy/=points.size();
-    mxy/=points.size();
-
-    float K = sqrt(pow(mxx+myy,2)-4*(mxx*myy-pow(mxy,2)));
-    RotatedRect temp;
-    temp.center = centroid;
-    Size stemp;
-    float l1 = (mxx+myy+K)/2;
-    float l2 = (mxx+myy-K)/2;
-    stemp.width = 2*sqrt(l1)*2.0;
-    stemp.height = 2*sqrt(l2)*2.0;
-    temp.size = stemp;
-    temp.angle = atan2(mxx-l1, -mxy)*180.0f/3.141592653589f;
-    return temp;
+    return moments.ellipse();
 }
 
 void TrackedObject::unOcclude(){
@@ -323,6 +529,33 @@ ObjectTracker::ObjectTracker(){
     initialized = true;
     frameNumber = 0;
     nextObjectIdx = 1;
+    onlineGMMIterations = 0;
+
+    useROI = false;
+    fullScanInterval = 10;
+    roiPadding = 0.2;
+    gateSigmas = 3;
+    useCamShift = false;
+    histogramPixelBudget = 0;
+    useMotionGate = false;
+    motionBlockSize = 16;
+    motionThreshold = 12;
+    lastFullScan = 0;
+    trackLost = false;
+    gatedScans = 0;
+
+    int channels[2] = {1,2};
+    float c1range[2] = {0,256};
+    float c2range[2] = {0,256};
+    int histSize[2] = {64,64};
+    quantizer = ColorQuantizer(CV_BGR2YCrCb, Histogram(channels, histSize, c1range, c2range), 5);
+}
+
+void ObjectTracker::setOnlineGMM(int iterations){
+    onlineGMMIterations = iterations;
+    for (int i=0; i<objectKinds.size(); i++){
+        objectKinds[i].setOnlineGMM(iterations);
+    }
 }
 
 void ObjectTracker::preprocess(const Mat image, Mat& outputImage, Mat& mask){
@@ -333,7 +566,7 @@ void ObjectTracker::preprocess(const Mat image, Mat& outputImage, Mat& mask){
     //Scalar highRange = Scalar(215,255,255);
     //inRange(procimg, lowRange, highRange, mask);
     mask = Mat::ones(image.size(), CV_8U)*255;
-    procimg.convertTo(outputImage, CV_32F);
+    outputImage = procimg;
 }
 
 bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> outMask){
@@ -356,6 +589,7 @@ bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> out
         int histSize[2] = {64,64};
         UpdatableHistogram objHist(channels, histSize, c1range, c2range, 5);
         objHist.fromImage(procimg, mask);
+        objHist.setOnlineGMM(onlineGMMIterations);
         objectKinds.push_back(objHist);
         largestObjOfKind.push_back(0);
     } catch (std::exception &e){
@@ -372,6 +606,7 @@ bool ObjectTracker::addObjectKind(std::string path){
     UpdatableHistogram objHist(channels, histSize, c1range, c2range, 5);
     bool cond = objHist.fromStored(path);
     if (cond){
+        objHist.setOnlineGMM(onlineGMMIterations);
         objectKinds.push_back(objHist);
         largestObjOfKind.push_back(0);
         return true;
@@ -397,15 +632,353 @@ bool ObjectTracker::addObjectKind(const vector<Mat> image, const vector<Mat> out
 }
 
 
-void ObjectTracker::getProbImages(const Mat procimg, const Mat mask, vector<Mat> &outputImages){
-    //first, get the general image histogram and use it to get a normalized probability image of the input image
-    double histMax = 0;
-    double histMin = 0;
-    outputImages.clear();
-    for (int i=0; i<objectKinds.size(); i++){
-        Mat objProb;
-        objectKinds[i].backPropagate(procimg, &objProb);
-        outputImages.push_back(objProb);
+void ObjectTracker::trackingWindows(Size imageSize, vector<Rect>& windows, bool merge){
+    windows.clear();
+    Rect frame(0, 0, imageSize.width, imageSize.height);
+    for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it){
+        Rect box = it->second->searchWindow(roiPadding, gateSigmas) & frame;
+        if (box.area()>0 || !merge){
+            windows.push_back(box);
+        }
+    }
+    //merge overlapping windows so no pixel is processed twice
+    bool merged = merge;
+    while (merged){
+        merged = false;
+        for (int i=0; i<windows.size() && !merged; i++){
+            for (int j=i+1; j<windows.size(); j++){
+                if ((windows[i] & windows[j]).area()>0){
+                    windows[i] = windows[i] | windows[j];
+                    windows.erase(windows.begin()+j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+bool ObjectTracker::camShiftObjects(const Mat inputImage, vector<RotatedRect>& results){
+    vector<Rect> windows;
+    trackingWindows(inputImage.size(), windows, false);
+    //overlapping windows need segmentation to tell the objects apart
+    for (int i=0; i<windows.size(); i++){
+        for (int j=i+1; j<windows.size(); j++){
+            if ((windows[i] & windows[j]).area()>0){
+                return false;
+            }
+        }
+    }
+    results.assign(windows.size(), RotatedRect());
+    Mat blurred;
+    Mat index;
+    Mat prob;
+    int k = 0;
+    for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it, ++k){
+        int kind = it->second->kind;
+        if (windows[k].area()==0 || kind<0 || kind>=objectKinds.size()){
+            continue;
+        }
+        blur(inputImage(windows[k]), blurred, Size(5,5));
+        quantizer.quantize(blurred, index);
+        getProbImage(index, kind, prob);
+        results[k] = it->second->useCamShift(prob, windows[k].tl());
+    }
+    return true;
+}
+
+static bool touching(const Rect& r1, const Rect& r2){
+    return (Rect(r1.x-1, r1.y-1, r1.width+2, r1.height+2) & r2).area()>0;
+}
+
+/* the frame is compared against the reference the cached blobs were computed from, so slow drifts add up until they
+   are noticed. All three color channels are compared since the segmentation is chromatic, a change of hue at equal
+   brightness has to be seen as well. Changed blocks are grown by one block to cover the blur footprint. Since the
+   hysteresis connects strong pixels through weak ones, the windows are then grown over every low threshold component
+   of the last segmentation they touch, so a blob is either recomputed whole or reused unchanged.
+   Returns true if the whole frame has to be segmented. */
+bool ObjectTracker::motionWindows(const Mat inputImage, vector<Rect>& windows, vector<Blob>& blobs, vector<int>& blobKinds){
+    Rect frame(0, 0, inputImage.cols, inputImage.rows);
+    windows.clear();
+    //the lookup tables may change without the image changing, so everything is redone periodically
+    if (motionReference.size()!=inputImage.size() || motionReference.type()!=inputImage.type() || kindLookup.cols!=objectKinds.size() || ++gatedScans>=fullScanInterval){
+        inputImage.copyTo(motionReference);
+        gatedScans = 0;
+        cachedSupport.clear();
+        windows.push_back(frame);
+        return true;
+    }
+
+    Mat diff;
+    absdiff(inputImage, motionReference, diff);
+    //the channels of a pixel lie side by side in a single channel view, so a block spans blockSize*3 columns
+    diff = diff.reshape(1, inputImage.rows);
+    threshold(diff, diff, motionThreshold, 255, THRESH_BINARY);
+    int blockSize = std::max(1, motionBlockSize);
+    Size grid((inputImage.cols+blockSize-1)/blockSize, (inputImage.rows+blockSize-1)/blockSize);
+    Mat changed;
+    //mean over each block, a block counts as changed when more than 1/32 of its channel values did
+    resize(diff, changed, grid, 0, 0, INTER_AREA);
+    changed = changed>8;
+    dilate(changed, changed, Mat());
+
+    for (int by=0; by<changed.rows; by++){
+        const uchar* row = changed.ptr<uchar>(by);
+        int bx = 0;
+        while (bx<changed.cols){
+            if (!row[bx]){
+                bx++;
+                continue;
+            }
+            int start = bx;
+            while (bx<changed.cols && row[bx]){
+                bx++;
+            }
+            windows.push_back(Rect(start*blockSize, by*blockSize, (bx-start)*blockSize, blockSize) & frame);
+        }
+    }
+
+    vector<char> kept(cachedSupport.size(), true);
+    bool merged = !windows.empty();
+    while (merged){
+        merged = false;
+        for (int i=0; i<windows.size(); i++){
+            for (int j=i+1; j<windows.size(); j++){
+                if (touching(windows[i], windows[j])){
+                    windows[i] = windows[i] | windows[j];
+                    windows.erase(windows.begin()+j);
+                    j--;
+                    merged = true;
+                }
+            }
+            for (int c=0; c<cachedSupport.size(); c++){
+                if (kept[c] && touching(windows[i], cachedSupport[c])){
+                    windows[i] = windows[i] | cachedSupport[c];
+                    kept[c] = false;
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    //components inside the windows are replaced by the ones found when the windows are segmented
+    vector<Rect> support;
+    for (int c=0; c<cachedSupport.size(); c++){
+        if (kept[c]){
+            support.push_back(cachedSupport[c]);
+        }
+    }
+    cachedSupport.swap(support);
+    for (int w=0; w<windows.size(); w++){
+        Mat refWindow = motionReference(windows[w]);
+        inputImage(windows[w]).copyTo(refWindow);
+    }
+    for (int b=0; b<cachedBlobs.size(); b++){
+        Rect box = cachedBlobs[b].boundingRect();
+        bool inside = false;
+        for (int w=0; w<windows.size() && !inside; w++){
+            inside = touching(windows[w], box);
+        }
+        if (!inside){
+            blobs.push_back(cachedBlobs[b]);
+            blobKinds.push_back(cachedBlobKinds[b]);
+        }
+    }
+    return windows.size()==1 && windows[0].area()==frame.area();
+}
+
+/* with a pixel budget only every stride-th row and column is counted, the sampling grid shifting every frame, and the
+   counts are scaled back to the full number of pixels */
+void ObjectTracker::frameHistogram(const Mat index, Mat& hist, int budget, int phase){
+    hist = Mat::zeros(quantizer.histSize[0], quantizer.histSize[1], CV_32F);
+    float* bins = hist.ptr<float>(0);
+    const int* lookup = quantizer.binLookup.ptr<int>(0);
+    double total = index.total();
+    int stride = 1;
+    if (budget>0 && total>budget){
+        stride = cvCeil(sqrt(total/budget));
+    }
+    int offsetY = phase%stride;
+    int offsetX = (phase/stride)%stride;
+    int sampled = 0;
+    for (int y=offsetY; y<index.rows; y+=stride){
+        const ushort* src = index.ptr<ushort>(y);
+        for (int x=offsetX; x<index.cols; x+=stride){
+            int bin = lookup[src[x]];
+            if (bin>=0){
+                bins[bin]++;
+            }
+            sampled++;
+        }
+    }
+    if (stride>1 && sampled>0){
+        hist *= total/sampled;
+    }
+}
+
+/* with a pixel budget every stride-th pixel along the concatenated runs is counted */
+void ObjectTracker::blobHistogram(const Mat index, const vector<Blob>& blobs, Mat& hist, int budget, int phase){
+    hist = Mat::zeros(quantizer.histSize[0], quantizer.histSize[1], CV_32F);
+    float* bins = hist.ptr<float>(0);
+    const int* lookup = quantizer.binLookup.ptr<int>(0);
+    double total = 0;
+    for (int b=0; b<blobs.size(); b++){
+        total += blobs[b].area();
+    }
+    int stride = 1;
+    if (budget>0 && total>budget){
+        stride = cvCeil(total/budget);
+    }
+    int skip = phase%stride;
+    int sampled = 0;
+    for (int b=0; b<blobs.size(); b++){
+        for (int r=0; r<blobs[b].runs.size(); r++){
+            const PixelRun& run = blobs[b].runs[r];
+            const ushort* src = index.ptr<ushort>(run.row);
+            int x = run.start+skip;
+            for (; x<run.end; x+=stride){
+                int bin = lookup[src[x]];
+                if (bin>=0){
+                    bins[bin]++;
+                }
+                sampled++;
+            }
+            skip = x-run.end;
+        }
+    }
+    if (stride>1 && sampled>0){
+        hist *= total/sampled;
+    }
+}
+
+void ObjectTracker::updateKindLookup(){
+    int kinds = objectKinds.size();
+    if (kinds==0){
+        return;
+    }
+    //per-kind tables are interleaved so that all probabilities of a color cell share a cache line
+    int cells = quantizer.binLookup.cols;
+    bool changed = kindLookup.rows!=cells || kindLookup.cols!=kinds;
+    for (int i=0; i<kinds; i++){
+        changed |= objectKinds[i].updateColorLookup(quantizer, 0.02);
+    }
+    if (changed){
+        kindLookup.create(cells, kinds, CV_8U);
+        for (int i=0; i<kinds; i++){
+            const uchar* lut = objectKinds[i].getColorLookup().ptr<uchar>(0);
+            for (int q=0; q<cells; q++){
+                kindLookup.at<uchar>(q,i) = lut[q];
+            }
+        }
+    }
+}
+
+void ObjectTracker::getProbImages(const Mat index, vector<Mat> &outputImages){
+    int kinds = objectKinds.size();
+    outputImages.resize(kinds);
+    if (kinds==0){
+        return;
+    }
+    updateKindLookup();
+
+    for (int i=0; i<kinds; i++){
+        outputImages[i].create(index.size(), CV_8UC1);
+    }
+    const uchar* table = kindLookup.ptr<uchar>(0);
+    vector<uchar*> dst(kinds);
+    for (int y=0; y<index.rows; y++){
+        const ushort* src = index.ptr<ushort>(y);
+        for (int i=0; i<kinds; i++){
+            dst[i] = outputImages[i].ptr<uchar>(y);
+        }
+        for (int x=0; x<index.cols; x++){
+            const uchar* prob = table + src[x]*kinds;
+            for (int i=0; i<kinds; i++){
+                dst[i][x] = prob[i];
+            }
+        }
+    }
+}
+
+//probability of a single kind, read from its column of the lookup table
+void ObjectTracker::getProbImage(const Mat index, int kind, Mat& outputImage){
+    int kinds = objectKinds.size();
+    updateKindLookup();
+    outputImage.create(index.size(), CV_8UC1);
+    const uchar* table = kindLookup.ptr<uchar>(0)+kind;
+    for (int y=0; y<index.rows; y++){
+        const ushort* src = index.ptr<ushort>(y);
+        uchar* dst = outputImage.ptr<uchar>(y);
+        for (int x=0; x<index.cols; x++){
+            dst[x] = table[src[x]*kinds];
+        }
+    }
+}
+
+/* blur, quantization, probability lookup and hysteresis classification are fused and run over strips of rows, so
+   every stage works on data still in cache. Only the quantized index, which the histogram updates need, is written
+   for the whole window; the probabilities go straight into per-kind runs and never reach memory as images. */
+void ObjectTracker::segmentWindow(const Mat image, Mat& index, vector<vector<Blob> >& kindBlobs, double lowThresh, double hiThresh, double minArea){
+    int kinds = objectKinds.size();
+    kindBlobs.resize(kinds);
+    index.create(image.size(), CV_16UC1);
+    if (kinds==0){
+        return;
+    }
+    updateKindLookup();
+    labelers.resize(kinds);
+    for (int i=0; i<kinds; i++){
+        labelers[i].reset();
+    }
+    int low = std::max(1, cvCeil(lowThresh*255));
+    int high = std::max(low, cvCeil(hiThresh*255));
+
+    //a 16 row strip of a 320 pixel wide BGR window and its index take 25 KB
+    const int stripRows = 16;
+    const uchar* table = kindLookup.ptr<uchar>(0);
+    vector<int> runStart(kinds);
+    vector<char> inRun(kinds);
+    vector<char> runStrong(kinds);
+    Mat blurred;
+    for (int y0=0; y0<image.rows; y0+=stripRows){
+        int y1 = std::min(image.rows, y0+stripRows);
+        //the strip reads its 2 row halo from the surrounding image like the window does, so the result matches a
+        //blur of the whole window
+        blur(image.rowRange(y0, y1), blurred, Size(5,5));
+        Mat indexStrip = index.rowRange(y0, y1);
+        quantizer.quantize(blurred, indexStrip);
+        for (int y=y0; y<y1; y++){
+            const ushort* src = index.ptr<ushort>(y);
+            for (int i=0; i<kinds; i++){
+                inRun[i] = false;
+            }
+            for (int x=0; x<image.cols; x++){
+                const uchar* prob = table + src[x]*kinds;
+                for (int i=0; i<kinds; i++){
+                    int p = prob[i];
+                    if (p>=low){
+                        if (!inRun[i]){
+                            inRun[i] = true;
+                            runStart[i] = x;
+                            runStrong[i] = false;
+                        }
+                        runStrong[i] |= p>=high;
+                    }
+                    else if (inRun[i]){
+                        inRun[i] = false;
+                        labelers[i].addRun(y, runStart[i], x, runStrong[i]);
+                    }
+                }
+            }
+            for (int i=0; i<kinds; i++){
+                if (inRun[i]){
+                    labelers[i].addRun(y, runStart[i], image.cols, runStrong[i]);
+                }
+            }
+        }
+    }
+    for (int i=0; i<kinds; i++){
+        labelers[i].label(minArea, kindBlobs[i]);
     }
 }
 
@@ -420,43 +993,97 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
         inputImage.copyTo(drawImg);
     }
 
-    vector<Mat> probImages;
     vector<Mat> binImages;
     Mat binImg;
     if (VISUALDEBUG){
         Mat temp(Mat::zeros(inputImage.size(), CV_8U));
         temp.copyTo(binImg);
+        for (int i=0; i<objectKinds.size(); i++){
+            binImages.push_back(Mat::zeros(inputImage.size(), CV_8U));
+        }
     }
-    Mat procimg;
-    Mat mask;
-    preprocess(inputImage, procimg, mask);
-    getProbImages(procimg, mask, probImages);
 
-    vector<vector<Point2i>> blobs;
+    //in ROI mode only windows around the tracked objects are segmented, with a periodic full frame scan to discover
+    //new objects. The histograms are only updated when the whole frame is segmented.
+    bool fullScan = !(useROI || useCamShift) || objects.empty() || trackLost || frameNumber-lastFullScan>=fullScanInterval;
+    vector<Rect> windows;
+    vector<Blob> blobs;
     vector<int> blobKinds;
-    for (int i=0; i<probImages.size(); i++){
-        //binarize the probability image
-        Mat temp;
-        vector<vector<Point2i>> tempBlobs;
-        hysteresisThreshold(probImages[i], temp, tempBlobs, 0.3, 0.7);
-        objectKinds[i].update(procimg, 0.3, temp);
-        for (int j=0; j<tempBlobs.size(); j++){
-            blobs.push_back(tempBlobs[j]);
-            blobKinds.push_back(i);
+    bool updateKinds = fullScan;
+    if (fullScan){
+        lastFullScan = frameNumber;
+        if (useMotionGate){
+            updateKinds = motionWindows(inputImage, windows, blobs, blobKinds);
+            if (VISUALDEBUG){
+                for (int j=0; j<blobs.size(); j++){
+                    blobs[j].toMask(binImages[blobKinds[j]], 255);
+                    blobs[j].toMask(binImg, 255);
+                }
+            }
         }
-        if (VISUALDEBUG){
-            binImages.push_back(temp);
-            bitwise_or(temp, binImg, binImg);
+        else {
+            windows.push_back(Rect(0, 0, inputImage.cols, inputImage.rows));
         }
     }
+    else {
+        //the cached blobs and their reference are only touched by full scans, the next one is gated against the last
+        trackingWindows(inputImage.size(), windows, true);
+    }
+
+    //in CamShift mode well separated objects are followed on their own probability window and skip segmentation
+    vector<RotatedRect> camShiftResults;
+    bool camShifted = !fullScan && useCamShift && camShiftObjects(inputImage, camShiftResults);
+    if (camShifted){
+        windows.clear();
+    }
+
+    //probabilities come straight from the quantized BGR image, and so do the histograms for the kind updates
+    Mat index;
+    Mat apriori;
+    for (int w=0; w<windows.size(); w++){
+        const Rect& window = windows[w];
+        //filtering a submatrix reads the border from the surrounding image, so windows match the full frame result
+        vector<vector<Blob> > kindBlobs;
+        segmentWindow(inputImage(window), index, kindBlobs, 0.3, 0.7, minimumAreaCutoff);
+        if (fullScan && useMotionGate){
+            vector<Rect> support;
+            for (int i=0; i<kindBlobs.size(); i++){
+                labelers[i].supportBounds(support);
+            }
+            for (int c=0; c<support.size(); c++){
+                cachedSupport.push_back(support[c]+window.tl());
+            }
+        }
+        if (updateKinds){
+            //the unmasked histogram of the frame is shared by all kinds
+            frameHistogram(index, apriori, histogramPixelBudget, frameNumber);
+        }
 
-    for (int k=0; k<blobs.size(); k++){
-        double area = blobs[k].size();
-        if (area<minimumAreaCutoff){
-            blobs.erase(blobs.begin()+k);
-            k--;
+        for (int i=0; i<kindBlobs.size(); i++){
+            vector<Blob>& tempBlobs = kindBlobs[i];
+            if (updateKinds){
+                Mat objectHist;
+                blobHistogram(index, tempBlobs, objectHist, histogramPixelBudget, frameNumber);
+                objectKinds[i].update(objectHist, apriori, 0.3);
+            }
+            for (int j=0; j<tempBlobs.size(); j++){
+                if (VISUALDEBUG){
+                    Mat binWindow = binImages[i](window);
+                    tempBlobs[j].toMask(binWindow, 255);
+                    Mat allWindow = binImg(window);
+                    tempBlobs[j].toMask(allWindow, 255);
+                }
+                tempBlobs[j].translate(window.x, window.y);
+                blobs.push_back(tempBlobs[j]);
+                blobKinds.push_back(i);
+            }
         }
     }
+    if (fullScan && useMotionGate){
+        cachedBlobs = blobs;
+        cachedBlobKinds = blobKinds;
+    }
+
     /* or use simple 2-means clustering to extract only larger blobs
         if (blobs.size()>4){
             double maxArea = blobs[0].size();
@@ -477,122 +1104,237 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
         }
         */
 
-    int objKeys[objects.size()];
-    int tObjIdx = 0;
+    vector<int> objKeys;
     for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it){
         it->second->tracked = false;
-        objKeys[tObjIdx] = it->first;
-        tObjIdx++;
+        objKeys.push_back(it->first);
+    }
+    if (camShifted){
+        for (int k=0; k<camShiftResults.size(); k++){
+            RotatedRect result = camShiftResults[k];
+            if (CV_PI/4*result.size.area()>=minimumAreaCutoff){
+                objects[objKeys[k]]->update(result);
+            }
+        }
     }
     /*
     for (int j=0; j<objects.size(); j++){
         objects[j]->tracked = false;
     }*/
 
-    int supportPoints[objects.size()][blobs.size()];
-    int blobsobject[objects.size()];
-
-    vector<vector<Point2i> > blobsForObjects;
-    for (int i=0; i<objects.size(); i++){
-        vector<Point2i> temp;
-        blobsobject[i] = -1;
-        blobsForObjects.push_back(temp);
-        for (int j=0; j<blobs.size(); j++){
-            supportPoints[i][j] = 0;
-        }
-    }
-
-
-    vector<vector<int> > objectsblob;
-    for (int i=0; i<blobs.size(); i++){
-        vector<int> temp;
-        objectsblob.push_back(temp);
-        for (int j=0; j<blobs[i].size(); j++){
-            Point2i pt = blobs[i][j];
-            for (int k=0; k<objects.size(); k++){
-                double dist = distEllipse2Point(objects[objKeys[k]]->ellipse, pt);
-                if (dist<1.0){
-                    supportPoints[k][i]+=1;
-                }
+    int numObjects = objKeys.size();
+    int numBlobs = blobs.size();
+
+    //rasterize the predicted ellipses once, indexed by image row
+    vector<EllipseTransform> transforms(numObjects);
+    vector<vector<ObjectSpan> > rowSpans(inputImage.rows);
+    for (int k=0; k<numObjects; k++){
+        transforms[k] = EllipseTransform(objects[objKeys[k]]->ellipse);
+        int top, bottom;
+        transforms[k].rowRange(inputImage.rows, top, bottom);
+        for (int y=top; y<=bottom; y++){
+            int start, end;
+            if (transforms[k].rowSpan(y, inputImage.cols, start, end)){
+                rowSpans[y].push_back(ObjectSpan(k, start, end));
             }
         }
     }
 
-    for (int i=0; i<blobs.size(); i++){
-        bool singleSupport = true;
-        int support = -1;
-        for (int j=0; j<objects.size(); j++){
-            if (blobsobject[j]== -1 && supportPoints[j][i]>0){
-                if(support==-1){
-                    support = j;
+    //sparse support: pixels of each blob inside the predicted ellipses it touches, as (object, overlap) pairs
+    vector<vector<pair<int,int> > > blobSupport(numBlobs);
+    for (int i=0; i<numBlobs; i++){
+        vector<pair<int,int> >& support = blobSupport[i];
+        for (int r=0; r<blobs[i].runs.size(); r++){
+            const PixelRun& run = blobs[i].runs[r];
+            const vector<ObjectSpan>& spans = rowSpans[run.row];
+            for (int s=0; s<spans.size(); s++){
+                int overlap = std::min(run.end, spans[s].end)-std::max(run.start, spans[s].start);
+                if (overlap<=0){
+                    continue;
                 }
-                else {
-                    singleSupport = false;
-                    break;
+                int c = 0;
+                while (c<support.size() && support[c].first!=spans[s].object){
+                    c++;
                 }
+                if (c==support.size()){
+                    support.push_back(make_pair(spans[s].object, 0));
+                }
+                support[c].second += overlap;
             }
         }
-        if (singleSupport && support!=-1){
-            blobsobject[support]=i;
-            objectsblob[i].push_back(support);
+        //pairs whose centroid falls outside the motion model's gate get no support
+        for (int c=0; c<support.size(); c++){
+            if (objects[objKeys[support[c].first]]->gateDistance(blobs[i].moments)>gateSigmas*gateSigmas){
+                support.erase(support.begin()+c);
+                c--;
+            }
         }
     }
 
+    //objects and blobs linked by support form independent assignment problems
+    vector<int> component(numObjects+numBlobs);
+    for (int n=0; n<component.size(); n++){
+        component[n] = n;
+    }
+    for (int i=0; i<numBlobs; i++){
+        for (int c=0; c<blobSupport[i].size(); c++){
+            int r1 = RunLabeler::findRoot(component, blobSupport[i][c].first);
+            int r2 = RunLabeler::findRoot(component, numObjects+i);
+            if (r1!=r2){
+                component[std::max(r1,r2)] = std::min(r1,r2);
+            }
+        }
+    }
+    vector<vector<int> > componentObjects(numObjects+numBlobs);
+    vector<vector<int> > componentBlobs(numObjects+numBlobs);
+    for (int k=0; k<numObjects; k++){
+        componentObjects[RunLabeler::findRoot(component, k)].push_back(k);
+    }
+    for (int i=0; i<numBlobs; i++){
+        componentBlobs[RunLabeler::findRoot(component, numObjects+i)].push_back(i);
+    }
 
-    for (int j=0; j<objects.size(); j++){
-        if (blobsobject[j] == -1){
-            int mostSupport = 0;
+    //one to one assignment maximizing the supported pixels within each component, then split and merge handling:
+    //an object left without a blob shares its best supported blob (merge), a blob left without an object joins its
+    //best supported object of the same kind (split) or starts a new object
+    vector<vector<int> > objectsblob(numBlobs);
+    vector<int> objectBlobCount(numObjects, 0);
+    vector<int> newBlobs;
+    //object index within its component, only the entries of the current component are set
+    vector<int> localObject(numObjects, -1);
+    //row-major object by blob cost of the current component, reused across components
+    vector<double> cost;
+    vector<int> assignment;
+    vector<char> blobTaken;
+    for (int root=0; root<component.size(); root++){
+        const vector<int>& compObjects = componentObjects[root];
+        const vector<int>& compBlobs = componentBlobs[root];
+        if (compBlobs.empty()){
+            continue;
+        }
+        if (compObjects.empty()){
+            newBlobs.insert(newBlobs.end(), compBlobs.begin(), compBlobs.end());
+            continue;
+        }
+        for (int a=0; a<compObjects.size(); a++){
+            localObject[compObjects[a]] = a;
+        }
+        int cols = compBlobs.size();
+        cost.assign(compObjects.size()*cols, 0);
+        for (int b=0; b<cols; b++){
+            const vector<pair<int,int> >& support = blobSupport[compBlobs[b]];
+            for (int c=0; c<support.size(); c++){
+                cost[localObject[support[c].first]*cols+b] = -support[c].second;
+            }
+        }
+        for (int a=0; a<compObjects.size(); a++){
+            localObject[compObjects[a]] = -1;
+        }
+        hungarianAssignment(cost, compObjects.size(), cols, assignment);
+
+        blobTaken.assign(cols, false);
+        for (int a=0; a<compObjects.size(); a++){
+            int b = assignment[a];
+            if (b>=0 && cost[a*cols+b]<0){
+                objectsblob[compBlobs[b]].push_back(compObjects[a]);
+                objectBlobCount[compObjects[a]]++;
+                blobTaken[b] = true;
+            }
+        }
+        for (int a=0; a<compObjects.size(); a++){
+            if (objectBlobCount[compObjects[a]]>0){
+                continue;
+            }
             int best = -1;
-            for (int i=0; i<blobs.size(); i++){
-                if (supportPoints[j][i]>mostSupport){
-                    mostSupport = supportPoints[j][i];
-                    best = i;
+            for (int b=0; b<compBlobs.size(); b++){
+                if (cost[a*cols+b]<0 && (best==-1 || cost[a*cols+b]<cost[a*cols+best])){
+                    best = b;
                 }
             }
             if (best!=-1){
-                blobsobject[j]=best;
-                objectsblob[best].push_back(j);
+                objectsblob[compBlobs[best]].push_back(compObjects[a]);
+                objectBlobCount[compObjects[a]]++;
+                blobTaken[best] = true;
+            }
+        }
+        for (int b=0; b<compBlobs.size(); b++){
+            if (blobTaken[b]){
+                continue;
+            }
+            int i = compBlobs[b];
+            int best = -1;
+            for (int a=0; a<compObjects.size(); a++){
+                if (cost[a*cols+b]<0 && objects[objKeys[compObjects[a]]]->kind==blobKinds[i] && (best==-1 || cost[a*cols+b]<cost[best*cols+b])){
+                    best = a;
+                }
+            }
+            if (best!=-1){
+                objectsblob[i].push_back(compObjects[best]);
+                objectBlobCount[compObjects[best]]++;
+            }
+            else {
+                newBlobs.push_back(i);
             }
         }
     }
 
-    vector<int> newBlobs;
-    for (int i=0; i<blobs.size(); i++){
-        if (objectsblob[i].size()>0){
-            for (int j=0; j<blobs[i].size(); j++){
-                Point2i pt = blobs[i][j];
-                bool claimed = false;
-                double distList[objectsblob[i].size()];
-                for (int k=0; k<objectsblob[i].size(); k++){
-                    int idx = objectsblob[i][k];
-                    int key = objKeys[idx];
-                    distList[k] = distEllipse2Point(objects[key]->ellipse, pt);
-                    if (distList[k]<1.0){
-                        claimed = true;
-                        blobsForObjects[idx].push_back(pt);
+    vector<Blob> blobsForObjects(numObjects);
+    vector<char> sharing(numObjects, false);
+    vector<float> runDistances;
+    //pieces of the blob being split, only the entries of its sharing objects are used
+    vector<Blob> pieces(numObjects);
+    for (int i=0; i<numBlobs; i++){
+        if (objectsblob[i].size()==1){
+            //a single object takes the whole blob, no need to look at individual pixels
+            blobsForObjects[objectsblob[i][0]].merge(blobs[i]);
+        }
+        else if (objectsblob[i].size()>1){
+            for (int k=0; k<objectsblob[i].size(); k++){
+                sharing[objectsblob[i][k]] = true;
+            }
+            for (int r=0; r<blobs[i].runs.size(); r++){
+                const PixelRun& run = blobs[i].runs[r];
+                const vector<ObjectSpan>& spans = rowSpans[run.row];
+                int length = run.end-run.start;
+                bool measured = false;
+                for (int x=run.start; x<run.end; x++){
+                    bool claimed = false;
+                    for (int s=0; s<spans.size(); s++){
+                        if (sharing[spans[s].object] && x>=spans[s].start && x<spans[s].end){
+                            claimed = true;
+                            pieces[spans[s].object].add(run.row, x, x+1);
+                        }
                     }
-                }
-                if (!claimed && objectsblob[i].size()>0){
-                    int best = objectsblob[i][0];
-                    double closest = distList[0];
-                    for (int k=1; k<objectsblob[i].size(); k++){
-                        int idx = objectsblob[i][k];
-                        if (closest>distList[k]){
-                            closest = distList[k];
-                            best = idx;
+                    if (!claimed){
+                        //pixels outside all ellipses go to the closest one, measured for the whole run at once
+                        if (!measured){
+                            runDistances.resize(objectsblob[i].size()*length);
+                            for (int k=0; k<objectsblob[i].size(); k++){
+                                transforms[objectsblob[i][k]].rowDistances(run.row, run.start, run.end, &runDistances[k*length]);
+                            }
+                            measured = true;
+                        }
+                        int best = 0;
+                        for (int k=1; k<objectsblob[i].size(); k++){
+                            if (runDistances[k*length+x-run.start]<runDistances[best*length+x-run.start]){
+                                best = k;
+                            }
                         }
+                        pieces[objectsblob[i][best]].add(run.row, x, x+1);
                     }
-                    blobsForObjects[best].push_back(pt);
                 }
             }
-        }
-        else {
-            newBlobs.push_back(i);
+            for (int k=0; k<objectsblob[i].size(); k++){
+                int idx = objectsblob[i][k];
+                blobsForObjects[idx].merge(pieces[idx]);
+                pieces[idx] = Blob();
+                sharing[idx] = false;
+            }
         }
     }
 
-    for (int i=0; i<objects.size(); i++){
-        if (blobsobject[i]!=-1){
+    for (int i=0; i<numObjects; i++){
+        if (objectBlobCount[i]>0){
             objects[objKeys[i]]->update(inputImage, blobsForObjects[i]);
             if (VISUALDEBUG){
                 boost::posix_time::ptime time_t_epoch(boost::gregorian::date(1970,1,1));
@@ -605,7 +1347,7 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
     }
 
     for (int i=0; i<newBlobs.size(); i++){
-        boost::shared_ptr<TrackedObject> temp(new TrackedObject(procimg, blobs[newBlobs[i]]));
+        boost::shared_ptr<TrackedObject> temp(new TrackedObject(inputImage, blobs[newBlobs[i]]));
         temp->kind = blobKinds[newBlobs[i]];
         int id = nextObjectIdx++;
         temp->id = id;
@@ -698,6 +1440,15 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
     */
 
 
+    //a lost track forces a full scan on the next frame, lost objects keep moving on their motion model meanwhile
+    trackLost = false;
+    for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it){
+        if (!it->second->tracked){
+            trackLost = true;
+            it->second->coastMotion();
+        }
+    }
+
     vector<int> deleteKeys;
 
     for (objMap::iterator it=objects.begin(); it!=objects.end(); ++it){
@@ -739,118 +1490,116 @@ void ObjectTracker::process(const Mat inputImage, Mat* outputImage){
 }
 
 
-//separating axis theorem implementation
+//separating axis test, same path as TrackedObject::compare
 bool intersectingOBB(RotatedRect obb1, RotatedRect obb2){
-    double radAng1 = -obb1.angle/180.0*3.1415927;
-    double radAng2 = -obb2.angle/180.0*3.1415927;
-    Mat rot1 = (Mat_<float>(2,2) << cos(radAng1), -sin(radAng1), sin(radAng1), cos(radAng1));
-    Mat rot2 = (Mat_<float>(2,2) << cos(radAng2), -sin(radAng2), sin(radAng2), cos(radAng2));
-    
-    Point2f vertices1[4];
-    obb1.points(vertices1);
-    Point2f vertices2[4];
-    obb2.points(vertices2);
-    
-    Mat points1(2,4,CV_32F);
-    Mat points2(2,4,CV_32F);
-    
-    for (int i=0; i<4; i++){
-        points1.at<float>(0,i)=vertices1[i].x;
-        points1.at<float>(1,i)=vertices1[i].y;
-        points2.at<float>(0,i)=vertices2[i].x;
-        points2.at<float>(1,i)=vertices2[i].y;
-    }
-    
-    Mat pt1rot = rot1*points1;
-    Mat pt2rot = rot1*points2;
-    double minx1 = 0;
-    double maxx1 = 0;
-    double minx2 = 0;
-    double maxx2 = 0;
-    double miny1 = 0;
-    double maxy1 = 0;
-    double miny2 = 0;
-    double maxy2 = 0;
-    minMaxLoc(pt1rot.row(0), &minx1, &maxx1);
-    minMaxLoc(pt2rot.row(0), &minx2, &maxx2);
-    minMaxLoc(pt1rot.row(1), &miny1, &maxy1);
-    minMaxLoc(pt2rot.row(1), &miny2, &maxy2);
-    
-    if (minx1>maxx2 || minx2>maxx1 || miny1>maxy2 || miny2>maxy1){
-        return false;
-    }
-    
-    pt1rot = rot2*points1;
-    pt2rot = rot2*points2;
-    minMaxLoc(pt1rot.row(0), &minx1, &maxx1);
-    minMaxLoc(pt2rot.row(0), &minx2, &maxx2);
-    minMaxLoc(pt1rot.row(1), &miny1, &maxy1);
-    minMaxLoc(pt2rot.row(1), &miny2, &maxy2);
-    
-    if (minx1>maxx2 || minx2>maxx1 || miny1>maxy2 || miny2>maxy1){
-        return false;
-    }
-    
-    return true;
+    return OrientedBox(obb1).intersects(OrientedBox(obb2));
 }
 
 double distEllipse2Point(RotatedRect ellipse, Point2f pt){
-    Point2f ptshift = pt-ellipse.center;
-    Point2f ptRot(0,0);
-    double ang = - ellipse.angle / 180.0 *  3.141592653589;
-    ptRot.x = (cos(ang)*ptshift.x - sin(ang)*ptshift.y)/(ellipse.size.width/2.0);
-    ptRot.y = (cos(ang)*ptshift.y + sin(ang)*ptshift.x)/(ellipse.size.height/2.0);
-
-    double distsq = pow(ptRot.x,2)+pow(ptRot.y,2);
-    return distsq;
+    return EllipseTransform(ellipse).distance(pt);
 }
 
-void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector < std::vector<cv::Point2i> > &blobs, double lowThresh, double hiThresh){
-    int label_count = 2;
-
-    Mat probImg;
-    inputImg.copyTo(probImg);
-    for(int y=0; y < probImg.rows; y++) {
-        const float *row = probImg.ptr<float>(y);
-        for(int x=0; x < probImg.cols; x++) {
-            if(row[x] > 1 || row [x] < hiThresh) {
+/* run-based two-pass labeling: pixels above lowThresh are collected into horizontal runs, runs overlapping in consecutive
+   rows are merged with union-find (4-connectivity), and only components containing a pixel above hiThresh and at least
+   minArea pixels are kept */
+void hysteresisThreshold(const cv::Mat inputImg, cv::Mat& binary, std::vector<Blob> &blobs, double lowThresh, double hiThresh, double minArea){
+    Mat probImg = inputImg;
+    if (inputImg.depth()!=CV_8U){
+        inputImg.convertTo(probImg, CV_8U, 255.0);
+    }
+    int low = std::max(1, cvCeil(lowThresh*255));
+    int high = std::max(low, cvCeil(hiThresh*255));
+
+    RunLabeler labeler;
+    for (int y=0; y<probImg.rows; y++){
+        const uchar* row = probImg.ptr<uchar>(y);
+        int x = 0;
+        while (x<probImg.cols){
+            if (row[x]<low){
+                x++;
                 continue;
             }
-
-            float ptVal = row[x];
-            cv::Rect rect;
-
-            int flags = 4 + FLOODFILL_FIXED_RANGE;
-            floodFill(probImg, cv::Point(x,y), label_count, &rect, ptVal-lowThresh, 1-ptVal, flags);
-
-            label_count++;
+            int start = x;
+            bool isStrong = false;
+            while (x<probImg.cols && row[x]>=low){
+                isStrong |= row[x]>=high;
+                x++;
+            }
+            labeler.addRun(y, start, x, isStrong);
         }
     }
+    labeler.label(minArea, blobs);
 
-    blobs.clear();
-    for (int i=0; i<label_count-2; i++){
-        vector<Point2i> temp;
-        blobs.push_back(temp);
+    binary.create(probImg.size(), CV_8UC1);
+    binary.setTo(Scalar(0));
+    for (int b=0; b<blobs.size(); b++){
+        blobs[b].toMask(binary, 255);
     }
+}
 
-    Mat temp(Mat::zeros(probImg.size(), CV_8UC1));
-
-    for(int y=0; y < probImg.rows; y++) {
-        const float *row = probImg.ptr<float>(y);
-        for(int x=0; x < probImg.cols; x++) {
-            if(row[x] < 2) {
-                continue;
+/* Hungarian algorithm with row and column potentials, O(n^3) in the larger dimension. The cost is row-major with cols
+   entries per row. Missing rows or columns are padded with zero cost, so rows may stay unassigned (-1) when there are
+   more rows than columns. */
+void hungarianAssignment(const vector<double>& cost, int rows, int cols, vector<int>& assignment){
+    assignment.assign(rows, -1);
+    if (rows==0 || cols==0){
+        return;
+    }
+    int size = std::max(rows, cols);
+    //1-based, index 0 is the virtual start column
+    vector<double> u(size+1, 0);
+    vector<double> v(size+1, 0);
+    vector<int> match(size+1, 0);
+    vector<int> way(size+1, 0);
+    vector<double> minv(size+1);
+    vector<char> used(size+1);
+    for (int i=1; i<=size; i++){
+        match[0] = i;
+        int j0 = 0;
+        std::fill(minv.begin(), minv.end(), DBL_MAX);
+        std::fill(used.begin(), used.end(), false);
+        do {
+            used[j0] = true;
+            int i0 = match[j0];
+            int j1 = 0;
+            double delta = DBL_MAX;
+            for (int j=1; j<=size; j++){
+                if (used[j]){
+                    continue;
+                }
+                double c = (i0<=rows && j<=cols) ? cost[(i0-1)*cols+j-1] : 0;
+                double reduced = c-u[i0]-v[j];
+                if (reduced<minv[j]){
+                    minv[j] = reduced;
+                    way[j] = j0;
+                }
+                if (minv[j]<delta){
+                    delta = minv[j];
+                    j1 = j;
+                }
             }
-
-            int ptVal = round(row[x]);
-            Point2i pt(x,y);
-            blobs[ptVal-2].push_back(pt);
-            temp.at<unsigned char>(pt)=255;
+            for (int j=0; j<=size; j++){
+                if (used[j]){
+                    u[match[j]] += delta;
+                    v[j] -= delta;
+                }
+                else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (match[j0]!=0);
+        do {
+            int j1 = way[j0];
+            match[j0] = match[j1];
+            j0 = j1;
+        } while (j0!=0);
+    }
+    for (int j=1; j<=cols; j++){
+        if (match[j]>=1 && match[j]<=rows){
+            assignment[match[j]-1] = j-1;
         }
     }
-
-    temp.copyTo(binary);
-
 }
 
 double distLine2Point(Point2d pt1, Point2d pt2, Point2d pt3){
@@ -865,29 +1614,7 @@ double distLine2Point(Point2d pt1, Point2d pt2, Point2d pt3){
 }
 
 double distRotatedRect(RotatedRect r1, RotatedRect r2){
-    Point2f points1[4];
-    Point2f points2[4];
-    r1.points(points1);
-    r2.points(points2);
-
-    int closest1 = 0;
-    int closest2 = 0;
-    double mindist = norm(points1[0]-points2[0]);
-
-    for (int i=0; i<4; i++){
-        Point2f pt1 = points1[i];
-        Point2f pt2 = points1[(i+1)%4];
-        for (int j=0; j<4; j++){
-            Point2f pt3 = points2[j];
-            Point2f pt4 = points2[(j+1)%4];
-            double dist = distLine2Point(pt1, pt2, pt3);
-            if (dist<mindist) {mindist = dist;}
-            dist = distLine2Point(pt3, pt4, pt1);
-            if (dist<mindist) {mindist = dist;}
-        }
-    }
-
-    return mindist;
+    return OrientedBox(r1).distance(OrientedBox(r2));
 }
 
 
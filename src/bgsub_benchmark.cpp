@@ -0,0 +1,103 @@
+/*
+ * bgsub_benchmark.cpp
+ *
+ * Times the MOG based BGSubtractor against RunningAvgBGSubtractor on QVGA frames and checks that the SSE2 and the
+ * scalar update of RunningAvgBGSubtractor produce the same foreground masks.
+ * Frames are read from a video file or image sequence pattern if one is given, otherwise a noisy synthetic scene
+ * with a moving square is generated. Exits with 1 if the masks differ or the running average is not at least 10
+ * times faster than MOG.
+ *
+ * Usage: bgsub-benchmark [video file or image sequence pattern]
+ */
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "ImgProcPipeline.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+using namespace cv;
+
+int main(int argc, char** argv)
+{
+    const Size qvga(320, 240);
+    const int syntheticFrames = 300;
+    vector<Mat> frames;
+    if (argc>1){
+        VideoCapture capture(argv[1]);
+        if (!capture.isOpened()){
+            std::cout << "Could not open " << argv[1] << std::endl;
+            return 1;
+        }
+        Mat frame;
+        while (capture.read(frame)){
+            Mat resized;
+            resize(frame, resized, qvga, 0, 0, INTER_AREA);
+            frames.push_back(resized);
+        }
+    }
+    else {
+        Mat scene(qvga, CV_8UC3);
+        randu(scene, Scalar(0,0,0), Scalar(256,256,256));
+        blur(scene, scene, Size(9,9));
+        for (int i=0; i<syntheticFrames; i++){
+            Mat frame = scene.clone();
+            Mat noise(qvga, CV_8UC3);
+            //8-bit noise cannot be negative, so it is drawn around an offset that is taken off again
+            randn(noise, Scalar(8,8,8), Scalar(3,3,3));
+            frame = frame+noise-Scalar(8,8,8);
+            int x = (i*3)%(qvga.width-40);
+            rectangle(frame, Rect(x, 100, 40, 40), Scalar(40,200,90), -1);
+            frames.push_back(frame);
+        }
+    }
+    if (frames.empty()){
+        std::cout << "No frames" << std::endl;
+        return 1;
+    }
+
+    BGSubtractor mog;
+    RunningAvgBGSubtractor halfRes;
+    RunningAvgBGSubtractor fullRes;
+    fullRes.halfResolution = false;
+    RunningAvgBGSubtractor scalarHalfRes;
+    scalarHalfRes.vectorized = false;
+    RunningAvgBGSubtractor scalarFullRes;
+    scalarFullRes.halfResolution = false;
+    scalarFullRes.vectorized = false;
+
+    ProcessingElement* elements[] = {&mog, &halfRes, &fullRes, &scalarHalfRes, &scalarFullRes};
+    const char* names[] = {"MOG", "running avg/2", "running avg", "scalar avg/2", "scalar avg"};
+    const int numElements = sizeof(elements)/sizeof(elements[0]);
+    double ticks[numElements] = {0};
+    int mismatches = 0;
+    for (int i=0; i<frames.size(); i++){
+        Mat outputs[numElements];
+        for (int e=0; e<numElements; e++){
+            double start = getTickCount();
+            elements[e]->process(frames[i], &outputs[e]);
+            ticks[e] += getTickCount()-start;
+        }
+        //the vectorized and scalar models see the same frames, so their masks must match exactly
+        Mat diff;
+        absdiff(outputs[1], outputs[3], diff);
+        mismatches += countNonZero(diff);
+        absdiff(outputs[2], outputs[4], diff);
+        mismatches += countNonZero(diff);
+    }
+
+    std::cout << frames.size() << " frames at " << qvga.width << "x" << qvga.height << std::endl;
+    std::cout << std::setw(16) << "model" << std::setw(12) << "ms/frame" << std::setw(12) << "speedup" << std::endl;
+    for (int e=0; e<numElements; e++){
+        double ms = 1000.0*ticks[e]/getTickFrequency()/frames.size();
+        std::cout << std::setw(16) << names[e] << std::setw(12) << std::fixed << std::setprecision(3) << ms
+                  << std::setw(12) << std::setprecision(1) << ticks[0]/std::max(ticks[e], 1.0) << std::endl;
+    }
+    double speedup = ticks[0]/std::max(ticks[1], 1.0);
+    std::cout << "SSE2/scalar mask mismatches: " << mismatches << std::endl;
+    std::cout << "Running average at half resolution is " << std::setprecision(1) << speedup << "x faster than MOG"
+              << (speedup>=10 ? "" : ", below the required 10x") << std::endl;
+    return (mismatches==0 && speedup>=10) ? 0 : 1;
+}
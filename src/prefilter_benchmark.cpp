@@ -0,0 +1,108 @@
+/*
+ * prefilter_benchmark.cpp
+ *
+ * Compares the ColorHistBackProject prefilters on a Dataset/GroundTruth image set.
+ * For every filter, each image is segmented with a histogram trained on all the other images (leave one out),
+ * thresholded at 0.5 and compared against its ground truth mask. Prints the mean intersection over union and the
+ * mean filtering time per image.
+ *
+ * Usage: prefilter-benchmark [root directory containing Dataset and GroundTruth]
+ */
+
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "boost/filesystem.hpp"
+#include "ImgProcPipeline.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+using namespace cv;
+using namespace boost::filesystem;
+
+int main(int argc, char** argv)
+{
+    path rootdir(argc>1 ? argv[1] : ".");
+    path dataDir = rootdir/"Dataset";
+    path gTruthDir = rootdir/"GroundTruth";
+    if (!exists(dataDir) || !exists(gTruthDir) || !is_directory(dataDir) || !is_directory(gTruthDir)){
+        std::cout << "Dataset and GroundTruth directories not found in " << rootdir.string() << std::endl;
+        return 1;
+    }
+
+    vector<Mat> images;
+    vector<Mat> masks;
+    directory_iterator end_itr;
+    for(directory_iterator itr(dataDir); itr!=end_itr; ++itr){
+        path filename = itr->path().stem();
+        for(directory_iterator itr2(gTruthDir); itr2!=end_itr; ++itr2){
+            if(filename==itr2->path().stem()){
+                Mat img(imread(itr->path().string()));
+                Mat mask(imread(itr2->path().string(),0));
+                if (!img.empty() && !mask.empty() && img.size()==mask.size()){
+                    images.push_back(img);
+                    masks.push_back(mask>127);
+                }
+            }
+        }
+    }
+    if (images.size()<2){
+        std::cout << "At least two annotated images are needed, found " << images.size() << std::endl;
+        return 1;
+    }
+
+    //same layout as the HLS backprojection in the main pipeline
+    int colorCode = CV_BGR2HLS;
+    int channels[2] = {0,1};
+    int histSize[2] = {32,32};
+    float c1range[2] = {0,180};
+    float c2range[2] = {0,256};
+    const float* ranges[] = {c1range, c2range};
+
+    Prefilter filters[] = {PREFILTER_NONE, PREFILTER_BOX, PREFILTER_GAUSSIAN, PREFILTER_BILATERAL_DOWNSAMPLED, PREFILTER_GUIDED, PREFILTER_BILATERAL};
+    const char* filterNames[] = {"none", "box", "gaussian", "bilateral/2", "guided", "bilateral"};
+
+    std::cout << std::setw(14) << "filter" << std::setw(12) << "mean IoU" << std::setw(14) << "ms/image" << std::endl;
+    for (int f=0; f<sizeof(filters)/sizeof(filters[0]); f++){
+        vector<Mat> converted(images.size());
+        vector<Mat> hists(images.size());
+        double ticks = 0;
+        for (int i=0; i<images.size(); i++){
+            Mat filtered;
+            double start = getTickCount();
+            applyPrefilter(images[i], filtered, filters[f]);
+            ticks += getTickCount()-start;
+            cvtColor(filtered, converted[i], colorCode);
+            calcHist(&converted[i], 1, channels, masks[i], hists[i], 2, histSize, ranges, true, false);
+        }
+        Mat total = Mat::zeros(histSize[0], histSize[1], CV_32F);
+        for (int i=0; i<hists.size(); i++){
+            total += hists[i];
+        }
+
+        double iouSum = 0;
+        for (int i=0; i<images.size(); i++){
+            Histogram model(channels, histSize, c1range, c2range);
+            Mat training = total-hists[i];
+            double histMax = 0;
+            minMaxLoc(training, NULL, &histMax);
+            training.convertTo(model.normalized, CV_32F, histMax>0 ? 1/histMax : 0);
+
+            Mat prob;
+            model.backPropagate8U(converted[i], &prob);
+            Mat segmented = prob>127;
+            Mat intersection;
+            Mat unionMask;
+            bitwise_and(segmented, masks[i], intersection);
+            bitwise_or(segmented, masks[i], unionMask);
+            int unionArea = countNonZero(unionMask);
+            iouSum += unionArea>0 ? countNonZero(intersection)/(double)unionArea : 1.0;
+        }
+
+        double ms = 1000.0*ticks/getTickFrequency()/images.size();
+        std::cout << std::setw(14) << filterNames[f] << std::setw(12) << std::fixed << std::setprecision(3) << iouSum/images.size()
+                  << std::setw(14) << std::setprecision(2) << ms << std::endl;
+    }
+    return 0;
+}